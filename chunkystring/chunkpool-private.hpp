@@ -0,0 +1,344 @@
+/*********************************************************************
+ * ChunkPool and ChunkAllocator classes.
+ *********************************************************************
+ *
+ * Implementation for the templated chunk pool and its allocator
+ *
+ */
+
+#include <cstdint>
+#include <new>
+
+template <size_t SlotSize, size_t Slots>
+const size_t ChunkPool<SlotSize, Slots>::SLOT_BYTES;
+
+template <size_t SlotSize, size_t Slots>
+ChunkPool<SlotSize, Slots>::ChunkPool()
+    : inUse_{0}, reserved_{0}, spares_{nullptr}, spareCount_{0},
+      blocks_{nullptr}, heapBytes_{0}, heapAllocations_{0}
+{
+    for (size_t i = 0; i < Slots; ++i)
+    {
+        used_[i] = false;
+    }
+}
+
+template <size_t SlotSize, size_t Slots>
+ChunkPool<SlotSize, Slots>::~ChunkPool()
+{
+    // By now the list has handed every slot back, so every block is
+    // entirely spare and release() frees them all
+    release();
+}
+
+template <size_t SlotSize, size_t Slots>
+void* ChunkPool<SlotSize, Slots>::allocate(size_t bytes)
+{
+    if (bytes > SLOT_BYTES)
+    {
+        void* p = ::operator new(bytes);
+        heapBytes_ += bytes;
+        ++heapAllocations_;
+        return p;
+    }
+
+    ++inUse_;
+
+    // Nodes that fit a slot take the first free in-object one...
+    for (size_t i = 0; i < Slots; ++i)
+    {
+        if (!used_[i])
+        {
+            used_[i] = true;
+            return slots_[i];
+        }
+    }
+
+    // ...then a spare, and only then a fresh slot
+    if (spares_ != nullptr)
+    {
+        return popSpare();
+    }
+    void* p = ::operator new(SLOT_BYTES);
+    heapBytes_ += SLOT_BYTES;
+    ++heapAllocations_;
+    return p;
+}
+
+template <size_t SlotSize, size_t Slots>
+void ChunkPool<SlotSize, Slots>::deallocate(void* p, size_t bytes)
+{
+    if (owns(p))
+    {
+        size_t i = (static_cast<unsigned char*>(p) - slots_[0]) / SLOT_BYTES;
+        used_[i] = false;
+        --inUse_;
+    }
+    else if (bytes <= SLOT_BYTES)
+    {
+        // Keep the slot if the reservation isn't met without it, or if
+        // it can't be freed on its own
+        --inUse_;
+        if (inUse_ + available() < reserved_ || inBlock(p))
+        {
+            pushSpare(p);
+        }
+        else
+        {
+            ::operator delete(p);
+            heapBytes_ -= SLOT_BYTES;
+            --heapAllocations_;
+        }
+    }
+    else
+    {
+        ::operator delete(p);
+        heapBytes_ -= bytes;
+        --heapAllocations_;
+    }
+}
+
+template <size_t SlotSize, size_t Slots>
+size_t ChunkPool<SlotSize, Slots>::available() const
+{
+    size_t inlineFree = 0;
+    for (size_t i = 0; i < Slots; ++i)
+    {
+        inlineFree += !used_[i];
+    }
+    return inlineFree + spareCount_;
+}
+
+template <size_t SlotSize, size_t Slots>
+size_t ChunkPool<SlotSize, Slots>::heapBytes() const
+{
+    return heapBytes_;
+}
+
+template <size_t SlotSize, size_t Slots>
+size_t ChunkPool<SlotSize, Slots>::heapAllocations() const
+{
+    return heapAllocations_;
+}
+
+template <size_t SlotSize, size_t Slots>
+void ChunkPool<SlotSize, Slots>::reserve(size_t count)
+{
+    if (inUse_ + count > reserved_)
+    {
+        reserved_ = inUse_ + count;
+    }
+    if (count <= available())
+    {
+        return;
+    }
+    size_t missing = count - available();
+
+    // One allocation: the header takes the first slot's worth of space,
+    // keeping the slots after it aligned
+    unsigned char* memory = static_cast<unsigned char*>(
+        ::operator new((missing + 1) * SLOT_BYTES));
+    Block* block = reinterpret_cast<Block*>(memory);
+    block->next_ = blocks_;
+    block->slots_ = missing;
+    blocks_ = block;
+    heapBytes_ += (missing + 1) * SLOT_BYTES;
+    ++heapAllocations_;
+
+    for (size_t i = missing; i > 0; --i)
+    {
+        pushSpare(memory + i * SLOT_BYTES);
+    }
+}
+
+template <size_t SlotSize, size_t Slots>
+void ChunkPool<SlotSize, Slots>::release()
+{
+    // Sorted by address, the spares inside each block come together,
+    // between the lone spares, so one pass over both lists counts them
+    spares_ = sortByAddress(spares_);
+    blocks_ = sortByAddress(blocks_);
+
+    Spare* keep = nullptr;      // spares in blocks still partly in use
+    Spare** keepEnd = &keep;
+    size_t keepCount = 0;
+    Spare* spare = spares_;
+    Block** link = &blocks_;
+    for (;;)
+    {
+        Block* block = *link;
+        uintptr_t first = block == nullptr ? UINTPTR_MAX
+                                           : address(block) + SLOT_BYTES;
+
+        // Spares before the block are in no block at all
+        while (spare != nullptr && address(spare) < first)
+        {
+            Spare* next = spare->next_;
+            ::operator delete(spare);
+            heapBytes_ -= SLOT_BYTES;
+            --heapAllocations_;
+            spare = next;
+        }
+        if (block == nullptr)
+        {
+            break;
+        }
+
+        Spare* inBlock = spare;
+        Spare** inBlockEnd = &inBlock;
+        size_t free = 0;
+        uintptr_t last = first + block->slots_ * SLOT_BYTES;
+        while (spare != nullptr && address(spare) < last)
+        {
+            ++free;
+            inBlockEnd = &spare->next_;
+            spare = spare->next_;
+        }
+
+        if (free == block->slots_)
+        {
+            // Its spares go with it
+            *link = block->next_;
+            heapBytes_ -= (block->slots_ + 1) * SLOT_BYTES;
+            --heapAllocations_;
+            ::operator delete(block);
+        }
+        else
+        {
+            if (free != 0)
+            {
+                *keepEnd = inBlock;
+                keepEnd = inBlockEnd;
+                keepCount += free;
+            }
+            link = &block->next_;
+        }
+    }
+    *keepEnd = nullptr;
+    spares_ = keep;
+    spareCount_ = keepCount;
+    reserved_ = 0;
+}
+
+template <size_t SlotSize, size_t Slots>
+bool ChunkPool<SlotSize, Slots>::owns(const void* p) const
+{
+    // Compare as integers; relational operators on unrelated pointers
+    // aren't guaranteed to be meaningful
+    uintptr_t addr = address(p);
+    uintptr_t first = address(slots_[0]);
+    return addr >= first && addr < first + Slots * SLOT_BYTES;
+}
+
+template <size_t SlotSize, size_t Slots>
+bool ChunkPool<SlotSize, Slots>::inBlock(const void* p) const
+{
+    uintptr_t addr = address(p);
+    for (const Block* block = blocks_; block != nullptr; 
+         block = block->next_)
+    {
+        uintptr_t first = address(block) + SLOT_BYTES;
+        if (addr >= first && addr < first + block->slots_ * SLOT_BYTES)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <size_t SlotSize, size_t Slots>
+uintptr_t ChunkPool<SlotSize, Slots>::address(const void* p)
+{
+    return reinterpret_cast<uintptr_t>(p);
+}
+
+template <size_t SlotSize, size_t Slots>
+template <typename Node>
+Node* ChunkPool<SlotSize, Slots>::sortByAddress(Node* list)
+{
+    if (list == nullptr || list->next_ == nullptr)
+    {
+        return list;
+    }
+
+    // Split after the middle node, sort the halves, and merge them
+    Node* middle = list;
+    for (Node* fast = list->next_; fast != nullptr && fast->next_ != nullptr;
+         fast = fast->next_->next_)
+    {
+        middle = middle->next_;
+    }
+    Node* back = middle->next_;
+    middle->next_ = nullptr;
+    Node* a = sortByAddress(list);
+    Node* b = sortByAddress(back);
+
+    Node* merged = nullptr;
+    Node** end = &merged;
+    while (a != nullptr && b != nullptr)
+    {
+        Node*& lower = address(a) < address(b) ? a : b;
+        *end = lower;
+        end = &lower->next_;
+        lower = lower->next_;
+    }
+    *end = a != nullptr ? a : b;
+    return merged;
+}
+
+template <size_t SlotSize, size_t Slots>
+void* ChunkPool<SlotSize, Slots>::popSpare()
+{
+    Spare* spare = spares_;
+    spares_ = spare->next_;
+    --spareCount_;
+    return spare;
+}
+
+template <size_t SlotSize, size_t Slots>
+void ChunkPool<SlotSize, Slots>::pushSpare(void* p)
+{
+    Spare* spare = static_cast<Spare*>(p);
+    spare->next_ = spares_;
+    spares_ = spare;
+    ++spareCount_;
+}
+
+template <typename T, typename Pool>
+ChunkAllocator<T, Pool>::ChunkAllocator(Pool* pool)
+    : pool_{pool}
+{
+    // Nothing to do here!
+}
+
+template <typename T, typename Pool>
+template <typename U>
+ChunkAllocator<T, Pool>::ChunkAllocator(const ChunkAllocator<U, Pool>& other)
+    : pool_{other.pool_}
+{
+    // Nothing to do here!
+}
+
+template <typename T, typename Pool>
+T* ChunkAllocator<T, Pool>::allocate(size_t n)
+{
+    return static_cast<T*>(pool_->allocate(n * sizeof(T)));
+}
+
+template <typename T, typename Pool>
+void ChunkAllocator<T, Pool>::deallocate(T* p, size_t n)
+{
+    pool_->deallocate(p, n * sizeof(T));
+}
+
+template <typename T, typename Pool>
+bool ChunkAllocator<T, Pool>::operator==(const ChunkAllocator& rhs) const
+{
+    return pool_ == rhs.pool_;
+}
+
+template <typename T, typename Pool>
+bool ChunkAllocator<T, Pool>::operator!=(const ChunkAllocator& rhs) const
+{
+    return !(*this == rhs);
+}
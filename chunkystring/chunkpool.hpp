@@ -0,0 +1,193 @@
+/**
+ * \file chunkpool.hpp
+ *
+ * \authors Ricky Pan, Iris Liu
+ *
+ * \brief Declares ChunkPool and ChunkAllocator, which let a ChunkyString
+ *        keep its first few chunks inside the ChunkyString object itself.
+ */
+
+#ifndef CHUNKPOOL_HPP_INCLUDED
+#define CHUNKPOOL_HPP_INCLUDED 1
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * \class ChunkPool
+ * \brief Slots that list nodes are carved from: a few inside the pool
+ *        object itself, plus spare heap slots kept for reuse.
+ *
+ * \details Each slot holds one list node of at most SlotSize bytes. A
+ *          request is served from a free in-object slot if there is one,
+ *          then from the spare list, and only then by `operator new`, so
+ *          a pool never runs out; it only stops saving allocations.
+ *
+ *          reserve() adds spares in one contiguous block and sets how
+ *          many slots, in use or spare, the pool keeps. Slots handed back
+ *          while the pool has fewer are kept as spares; beyond that they
+ *          go back to the heap, so memory follows the list down again.
+ *          Slots in a block can only be freed with the whole block, so
+ *          they are always kept; release() frees every spare that isn't.
+ *
+ *          A pool lives inside the object whose list allocates from it,
+ *          so it can be neither copied nor moved.
+ *
+ * \tparam SlotSize  bytes needed for one list node
+ * \tparam Slots     number of nodes stored in the object
+ */
+template <size_t SlotSize, size_t Slots>
+class ChunkPool {
+public:
+    /// Slot size rounded up so every slot is suitably aligned
+    static const size_t SLOT_BYTES =
+        (SlotSize + alignof(std::max_align_t) - 1)
+            / alignof(std::max_align_t) * alignof(std::max_align_t);
+
+    ///< Default constructor: all slots free
+    ChunkPool();
+
+    /// Frees the spare slots and reserved blocks
+    ~ChunkPool();
+
+    ChunkPool(const ChunkPool&) = delete;
+    ChunkPool& operator=(const ChunkPool&) = delete;
+
+    /**
+     * \brief Hand out storage for bytes bytes
+     *
+     * \note constant time; only calls `operator new` once the in-object
+     *       slots and spares are exhausted
+     */
+    void* allocate(size_t bytes);
+
+    /**
+     * \brief Return storage obtained from allocate()
+     *
+     * \details A slot becomes a spare if the pool holds no more slots
+     *          than reserve() asked for, or if it is part of a block;
+     *          otherwise it is freed.
+     *
+     * \note constant time, except that past the reservation, finding out
+     *       whether a slot is in a block is linear in the blocks
+     */
+    void deallocate(void* p, size_t bytes);
+
+    /// Number of slots that can be handed out without allocating
+    size_t available() const;
+
+    /// Bytes currently obtained from `operator new` (slots and blocks)
+    size_t heapBytes() const;
+
+    /// Number of live `operator new` allocations
+    size_t heapAllocations() const;
+
+    /**
+     * \brief Make sure at least count slots are available
+     *
+     * \details Any shortfall is allocated as a single block. Until
+     *          release(), the pool then keeps at least as many slots as it
+     *          has in use plus count.
+     */
+    void reserve(size_t count);
+
+    /**
+     * \brief Free the spare slots and drop the reservation
+     *
+     * \details Blocks from reserve() can only be freed as a whole, so
+     *          spares in a block that still has slots in use are kept.
+     *
+     * \note O(n log n) in the spares and blocks: both are sorted by
+     *       address so a single pass matches spares to their blocks
+     */
+    void release();
+
+private:
+    /// Links spare slots together; stored in the slot itself
+    struct Spare {
+        Spare* next_;
+    };
+
+    /// Header at the start of each block allocated by reserve()
+    struct Block {
+        Block* next_;
+        size_t slots_;
+    };
+
+    /// True if p points into the in-object slots
+    bool owns(const void* p) const;
+
+    /// True if p is a slot in a block from reserve(); linear in the
+    /// blocks
+    bool inBlock(const void* p) const;
+
+    /// p as an integer, so unrelated pointers can be ordered
+    static uintptr_t address(const void* p);
+
+    /**
+     * \brief Sort a list of Spares or Blocks by address
+     *
+     * \details A merge sort on the links themselves, so it needs no
+     *          memory of its own and can run in the destructor.
+     */
+    template <typename Node>
+    static Node* sortByAddress(Node* list);
+
+    /// Pop a spare slot; there must be one
+    void* popSpare();
+
+    /// Push a slot onto the spare list
+    void pushSpare(void* p);
+
+    alignas(std::max_align_t) unsigned char slots_[Slots][SLOT_BYTES];
+    bool used_[Slots];
+    size_t inUse_;          // slots handed out and not yet returned
+    size_t reserved_;       // slots to keep, in use or spare
+    Spare* spares_;
+    size_t spareCount_;
+    Block* blocks_;
+    size_t heapBytes_;
+    size_t heapAllocations_;
+};
+
+/**
+ * \class ChunkAllocator
+ * \brief STL allocator that draws from a ChunkPool.
+ *
+ * \details Allocators compare equal when they share a pool, so lists using
+ *          the same pool may splice and swap nodes freely. Lists using
+ *          different pools must never exchange nodes.
+ */
+template <typename T, typename Pool>
+class ChunkAllocator {
+public:
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = ChunkAllocator<U, Pool>;
+    };
+
+    /// Allocate from the given pool
+    explicit ChunkAllocator(Pool* pool);
+
+    /// Rebinding copy: same pool, different element type
+    template <typename U>
+    ChunkAllocator(const ChunkAllocator<U, Pool>& other);
+
+    T* allocate(size_t n);
+    void deallocate(T* p, size_t n);
+
+    bool operator==(const ChunkAllocator& rhs) const;
+    bool operator!=(const ChunkAllocator& rhs) const;
+
+private:
+    template <typename U, typename P>
+    friend class ChunkAllocator;
+
+    Pool* pool_;
+};
+
+#include "chunkpool-private.hpp"
+
+#endif // CHUNKPOOL_HPP_INCLUDED
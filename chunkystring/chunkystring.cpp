@@ -6,21 +6,315 @@
 
 #include "chunkystring.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Set to 1 (e.g., with -DCHUNKYSTRING_INSTRUMENT=1) to record
+// ChunkyString::OpCounters; at 0 the hooks below compile to nothing.
+#ifndef CHUNKYSTRING_INSTRUMENT
+#define CHUNKYSTRING_INSTRUMENT 0
+#endif
+
+static thread_local ChunkyString::OpCounters opCounters;
+
+#if CHUNKYSTRING_INSTRUMENT
+/**
+ * \brief Times one operation, filing its latency and any heap allocations
+ *        it made when it goes out of scope.
+ *
+ * \tparam Pool  the ChunkPool the operation allocates from
+ */
+template <typename Pool>
+class OpTimer {
+public:
+    OpTimer(ChunkyString::Event event, const Pool& pool)
+        : event_{event}, pool_(pool),
+          allocations_{pool.heapAllocations()},
+          start_{std::chrono::steady_clock::now()}
+    {
+        // Nothing else to do here!
+    }
+
+    ~OpTimer()
+    {
+        unsigned long long ns =
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start_).count();
+        size_t bucket = 0;
+        while (ns >>= 1)
+        {
+            ++bucket;
+        }
+        bucket = std::min(bucket, ChunkyString::LATENCY_BUCKETS - 1);
+
+        ++opCounters.counts_[event_];
+        ++opCounters.latencies_[event_][bucket];
+        if (pool_.heapAllocations() > allocations_)
+        {
+            opCounters.counts_[ChunkyString::ALLOCATION] += 
+                pool_.heapAllocations() - allocations_;
+        }
+    }
+
+private:
+    ChunkyString::Event event_;
+    const Pool& pool_;
+    size_t allocations_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#define INSTRUMENT_OP(event) \
+    OpTimer<ChunkPoolType> opTimer(ChunkyString::event, pool_)
+#define INSTRUMENT_COUNT(event) ++opCounters.counts_[ChunkyString::event]
+#else
+#define INSTRUMENT_OP(event)
+#define INSTRUMENT_COUNT(event)
+#endif
+
+/// True if c starts a UTF-8 code point, i.e., is not a continuation byte.
+static inline bool isLead(char c)
+{
+    return (static_cast<unsigned char>(c) & 0xC0) != 0x80;
+}
+
+/// True if s keeps its characters in a heap buffer of their own, rather
+/// than inside the string object.
+static bool onHeap(const std::string& s)
+{
+    return s.capacity() > std::string().capacity();
+}
+
+/// Number of code-point lead bytes among the n at chars.
+static inline size_t leadsIn(const char* chars, size_t n)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        count += isLead(chars[i]);
+    }
+    return count;
+}
+
+/**
+ * \brief Classifies a UTF-8 lead byte
+ *
+ * \param b     the lead byte
+ * \param lo    set to the smallest allowed value of the next byte
+ * \param hi    set to the largest allowed value of the next byte
+ *
+ * \returns the number of continuation bytes that must follow b, or -1 if
+ *   b can never start a well-formed sequence.
+ */
+static inline int leadLength(unsigned char b, unsigned char& lo,
+                             unsigned char& hi)
+{
+    lo = 0x80;
+    hi = 0xBF;
+    if (b < 0x80)
+    {
+        return 0;
+    }
+    else if (b >= 0xC2 && b <= 0xDF)
+    {
+        return 1;
+    }
+    else if (b >= 0xE0 && b <= 0xEF)
+    {
+        // Reject overlong forms (E0) and UTF-16 surrogates (ED)
+        if (b == 0xE0)
+        {
+            lo = 0xA0;
+        }
+        if (b == 0xED)
+        {
+            hi = 0x9F;
+        }
+        return 2;
+    }
+    else if (b >= 0xF0 && b <= 0xF4)
+    {
+        // Reject overlong forms (F0) and code points past U+10FFFF (F4)
+        if (b == 0xF0)
+        {
+            lo = 0x90;
+        }
+        if (b == 0xF4)
+        {
+            hi = 0x8F;
+        }
+        return 3;
+    }
+    return -1;
+}
+
+/// True if none of the eight bytes at p has its high bit set.
+static inline bool isAscii8(const unsigned char* p)
+{
+    uint64_t word;
+    std::memcpy(&word, p, sizeof(word));
+    return (word & 0x8080808080808080ULL) == 0;
+}
+
+/// One lock and list of live strings; a cache line each, so threads
+/// registering in different shards don't slow each other down
+struct alignas(64) ChunkyString::LiveShard {
+    std::mutex mutex_;
+    ChunkyString* first_ = nullptr;
+};
+
+const size_t ChunkyString::LIVE_SHARDS;
+ChunkyString::LiveShard ChunkyString::liveShards_[LIVE_SHARDS];
+const size_t ChunkyString::npos;
+const size_t ChunkyString::PARALLEL_GRAIN;
+
+/// Repack 2 chunks per edit while less than half the cells are in use.
+static const ChunkyString::ReflowPolicy DEFAULT_POLICY = { 0.5, 2 };
+
+/// Run work(0) ... work(parts - 1) at once, work(0) on this thread
+template <typename F>
+static void inParallel(size_t parts, F work)
+{
+    std::vector<std::thread> threads;
+    for (size_t part = 1; part < parts; ++part)
+    {
+        threads.push_back(std::thread(work, part));
+    }
+    work(0);
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+/// Lower earliest to part, unless it's already lower
+static void lowerTo(std::atomic<size_t>& earliest, size_t part)
+{
+    size_t seen = earliest.load();
+    while (part < seen && !earliest.compare_exchange_weak(seen, part))
+    {
+        // seen was reloaded; try again
+    }
+}
+
+/// Edits recorded for undo() and redo(); steps that have been undone
+/// move from undo_ to redo_ and back, keeping their order
+struct ChunkyString::Journal {
+    /// One recorded edit: erased_ at offset_ was replaced by inserted_
+    struct Entry {
+        size_t offset_;
+        std::string erased_;
+        std::string inserted_;
+        bool chained_;      // undone along with the entry before it
+    };
+
+    std::vector<Entry> undo_;
+    std::vector<Entry> redo_;
+    bool open_ = false;     // the last entry of undo_ may still grow
+
+    /// Index in entries of the first entry of the last step
+    static size_t stepStart(const std::vector<Entry>& entries)
+    {
+        size_t start = entries.size() - 1;
+        while (entries[start].chained_)
+        {
+            --start;
+        }
+        return start;
+    }
+};
+
+/// What only some strings need: marks, journaling, snapshots, an
+/// unfinished compaction pass, or a reflow policy of their own
+struct ChunkyString::Extras {
+    explicit Extras(ChunkList::iterator end)
+        : compactAt_{end}, policy_(DEFAULT_POLICY)
+    {
+        // Nothing to do here!
+    }
+
+    // Recorded edits while journaling, nullptr otherwise
+    std::unique_ptr<Journal> journal_;
+
+    // The marks on each chunk; marks at end() are under nullptr. Chunks
+    // without marks have no entry.
+    std::unordered_map<const Chunk*, std::vector<Mark*>> marksIn_;
+
+    // Contents as of the last snapshot(); every modification forgets it
+    std::weak_ptr<const std::string> snapshot_;
+
+    // Next chunk compact_step() will fill, or end() to start a new pass.
+    ChunkList::iterator compactAt_;
+    ReflowPolicy policy_;
+};
+
+ChunkyString::Extras& ChunkyString::extras()
+{
+    if (!extras_)
+    {
+        extras_.reset(new Extras(chunks_.end()));
+    }
+    return *extras_;
+}
+
+inline ChunkyString::Journal* ChunkyString::journal() const
+{
+    return extras_ ? extras_->journal_.get() : nullptr;
+}
+
+inline bool ChunkyString::hasMarks() const
+{
+    return extras_ && !extras_->marksIn_.empty();
+}
+
+void ChunkyString::restartCompaction()
+{
+    if (extras_)
+    {
+        extras_->compactAt_ = chunks_.end();
+    }
+}
 
 ChunkyString::ChunkyString()
-    : size_{0}
+    : chunks_{ChunkList::allocator_type(&pool_)}, size_{0},
+      hash_{UNHASHED}
+{
+    registerLive();
+}
+
+ChunkyString::~ChunkyString()
 {
-    std::list<Chunk> chunks;
-    chunks_ = chunks;
+    if (extras_)
+    {
+        for (auto& chunkMarks : extras_->marksIn_)
+        {
+            for (Mark* mark : chunkMarks.second)
+            {
+                mark->owner_ = nullptr;
+            }
+        }
+    }
+    unregisterLive();
 }
 
 ChunkyString::ChunkyString(const ChunkyString& orig)
+    : chunks_{ChunkList::allocator_type(&pool_)}, hash_{UNHASHED}
 {
     // initialize default values for a ChunkyString
     size_ = 0;
-    std::list<Chunk> chunks;
-    chunks_ = chunks;
+    registerLive();
+    if (orig.extras_)
+    {
+        // of the optional state, only the reflow policy is copied
+        extras().policy_ = orig.extras_->policy_;
+    }
 
     // pushes all of the elements in orig into our ChunkyString
     for(const_iterator i = orig.begin(); i != orig.end(); ++i)
@@ -29,24 +323,92 @@ ChunkyString::ChunkyString(const ChunkyString& orig)
     }
 }
 
+ChunkyString& ChunkyString::operator=(const ChunkyString& rhs)
+{
+    if (this != &rhs)
+    {
+        // marks keep their offsets, as far as the new contents reach
+        std::vector<MarkOffset> marks = liftMarks();
+
+        // the list keeps its own allocator, so nodes stay in our pool
+        chunks_ = rhs.chunks_;
+        size_ = rhs.size_;
+        restartCompaction();
+        changed();
+        hash_.store(rhs.hash_.load(std::memory_order_relaxed),
+                    std::memory_order_relaxed);
+
+        dropMarks(marks);
+        if (journal())
+        {
+            extras_->journal_.reset(new Journal());
+        }
+    }
+    return *this;
+}
+
+void ChunkyString::assign(const char* chars, size_t n, size_t threads)
+{
+    std::vector<MarkOffset> marks = liftMarks();
+    size_t count = (n + CHUNKSIZE - 1) / CHUNKSIZE;
+    size_t parts = threadsFor(n, threads);
+    size_t perPart = count / parts;     // the last part takes the rest
+
+    // allocation isn't thread-safe, so every chunk is made here, noting
+    // where each part starts
+    chunks_.clear();
+    pool_.reserve(count);
+    std::vector<ChunkList::iterator> starts;
+    for (size_t k = 0; k < count; ++k)
+    {
+        chunks_.push_back(Chunk(0, CHUNKSIZE));
+        if (k % perPart == 0 && starts.size() < parts)
+        {
+            starts.push_back(std::prev(chunks_.end()));
+        }
+    }
+
+    inParallel(parts, [&](size_t part) {
+        size_t first = part * perPart;
+        size_t last = part + 1 == parts ? count : first + perPart;
+        ChunkList::iterator c = starts.empty() ? chunks_.end() 
+                                               : starts[part];
+        for (size_t k = first; k < last; ++k, ++c)
+        {
+            c->length_ = std::min(size_t(CHUNKSIZE), n - k * CHUNKSIZE);
+            std::memcpy(c->chars_, chars + k * CHUNKSIZE, c->length_);
+            recount(*c);
+        }
+    });
+
+    size_ = n;
+    restartCompaction();
+    changed();
+    dropMarks(marks);
+    if (journal())
+    {
+        extras_->journal_.reset(new Journal());
+    }
+}
+
 ChunkyString::iterator ChunkyString::begin() 
 {
-    return Iterator<false>(chunks_.begin(), 0);
+    return Iterator<false>(chunks_.begin(), 0, this);
 }
 
 ChunkyString::iterator ChunkyString::end() 
 {
-    return Iterator<false>(chunks_.end(), 0);
+    return Iterator<false>(chunks_.end(), 0, this);
 }
 
 ChunkyString::const_iterator ChunkyString::begin() const
 {
-    return Iterator<true>(chunks_.begin(), 0);
+    return Iterator<true>(chunks_.begin(), 0, this);
 }
 
 ChunkyString::const_iterator ChunkyString::end() const
 {
-    return Iterator<true>(chunks_.end(), 0);
+    return Iterator<true>(chunks_.end(), 0, this);
 }
 
 ChunkyString& ChunkyString::operator+=(const ChunkyString& rhs)
@@ -64,6 +426,17 @@ ChunkyString& ChunkyString::operator+=(const ChunkyString& rhs)
 
 void ChunkyString::push_back(char c)
 {
+    INSTRUMENT_OP(PUSH_BACK);
+    appendChar(c);
+}
+
+void ChunkyString::appendChar(char c)
+{
+    if (journal())
+    {
+        recordInsert(size_, c);
+    }
+
     // adds a char c to the end of our ChunkyString
     if (size_ == 0 || chunks_.back().length_ == CHUNKSIZE)
     {
@@ -81,76 +454,2309 @@ void ChunkyString::push_back(char c)
         chunks_.back().chars_[nextInd] = c;
         chunks_.back().length_ += 1;
     }
-    ++size_;    
+
+    chunks_.back().codepoints_ += isLead(c);
+    ++size_;
+    changed();
 }
 
-size_t ChunkyString::size() const
+ChunkyString::iterator ChunkyString::insert(iterator i, char c)
 {
-    return size_;
+    INSTRUMENT_OP(INSERT);
+
+    // inserting before end() appends, filling the last chunk and then
+    // adding a new one, never splitting
+    if (i.chunk_ == chunks_.end())
+    {
+        appendChar(c);
+        return iterator(std::prev(chunks_.end()), chunks_.back().length_ - 1,
+                        this);
+    }
+
+    ChunkList::iterator chunk = i.chunk_;
+    size_t index = i.index();
+    if (journal())
+    {
+        recordInsert(offsetOf(i), c);
+    }
+
+    if (chunk->length_ == CHUNKSIZE)
+    {
+        // use the free space of the chunk before if the character can go
+        // there, and split the chunk otherwise; iterators never sit one
+        // past a chunk's end, so index is less than CHUNKSIZE
+        if (index == 0 && chunk != chunks_.begin()
+            && std::prev(chunk)->length_ < CHUNKSIZE)
+        {
+            --chunk;
+            index = chunk->length_;
+        }
+        else
+        {
+            splitChunk(chunk);
+            if (index > chunk->length_)
+            {
+                index -= chunk->length_;
+                ++chunk;
+            }
+        }
+    }
+
+    // shift the rest of the chunk over to make room
+    std::memmove(chunk->chars_ + index + 1, chunk->chars_ + index,
+                 chunk->length_ - index);
+    chunk->chars_[index] = c;
+    ++chunk->length_;
+    shiftMarks(chunk, index, CHUNKSIZE, chunk, 1);
+    chunk->codepoints_ += isLead(c);
+    ++size_;
+    changed();
+
+    iterator inserted(chunk, index, this);
+    reflow(inserted);
+    return inserted;
 }
 
-bool ChunkyString::operator==(const ChunkyString& rhs) const
+ChunkyString::iterator ChunkyString::erase(iterator i)
 {
-    if(size_ != rhs.size_)
+    INSTRUMENT_OP(ERASE);
+    if (journal())
     {
-        return false;
+        recordErase(offsetOf(i), *i.cur_);
+    }
+
+    ChunkList::iterator chunk = i.chunk_;
+    size_t index = i.index();
+
+    chunk->codepoints_ -= isLead(chunk->chars_[index]);
+    std::memmove(chunk->chars_ + index, chunk->chars_ + index + 1,
+                 chunk->length_ - index - 1);
+    --chunk->length_;
+    --size_;
+    changed();
+
+    // marks on the erased character now mark the one after it
+    shiftMarks(chunk, index + 1, CHUNKSIZE, chunk, -1);
+    if (index == chunk->length_)
+    {
+        shiftMarks(chunk, index, CHUNKSIZE, std::next(chunk), -index);
     }
 
-    // Initializes 1 iterator to loop through each ChunkyString
-    const_iterator a = this->begin();
-    const_iterator b = rhs.begin();
+    // erasing a chunk's last character leaves us at the next chunk
+    iterator after(chunk, index, this);
+    if (index == chunk->length_)
+    {
+        after = iterator(std::next(chunk), 0, this);
+    }
 
-    for(size_t i = 0; i < size_; ++i)
+    if (chunk->length_ == 0)
+    {
+        eraseChunk(chunk);
+    }
+    else
     {
-        if(*a != *b)
+        // merge with a neighbor if the two fit in one chunk
+        ChunkList::iterator next = std::next(chunk);
+        if (next != chunks_.end() && chunk->length_ + next->length_ <= CHUNKSIZE)
         {
-            return false;
+            fillChunk(chunk, &after);
         }
-        else
+        else if (chunk != chunks_.begin()
+                 && std::prev(chunk)->length_ + chunk->length_ <= CHUNKSIZE)
         {
-            // increments iterators
-            ++a;
-            ++b;
+            fillChunk(std::prev(chunk), &after);
         }
     }
-    return true;
+
+    reflow(after);
+    return after;
 }
 
-bool ChunkyString::operator!=(const ChunkyString& rhs) const
+ChunkyString::iterator ChunkyString::replace(iterator first, iterator last,
+                                             const char* s, size_t n)
 {
-    // Idiomatic code: leverage == to implement !=
-    return !(*this == rhs);
+    size_t length = std::distance(first, last);
+    size_t overlap = std::min(length, n);
+    changed();
+    if (journal() && (length != 0 || n != 0))
+    {
+        recordReplace(offsetOf(first), 
+                      std::string(const_iterator(first), 
+                                  const_iterator(last)),
+                      std::string(s, n), false);
+    }
+
+    // overwrite what both sides have
+    ChunkList::iterator c = first.chunk_;
+    size_t i = c == chunks_.end() ? 0 : first.index();
+    for (size_t done = 0; done < overlap; )
+    {
+        size_t take = std::min(c->length_ - i, overlap - done);
+        c->codepoints_ -= leadsIn(c->chars_ + i, take);
+        c->codepoints_ += leadsIn(s + done, take);
+        std::memcpy(c->chars_ + i, s + done, take);
+        done += take;
+        i += take;
+        if (i == c->length_)
+        {
+            ++c;
+            i = 0;
+        }
+    }
+
+    // overwritten characters count as replaced, so their marks join the
+    // ones after them, which the erase or insert below moves into place
+    if (hasMarks() && overlap != 0)
+    {
+        ChunkList::iterator from = first.chunk_;
+        size_t lo = first.index();
+        while (from != c)
+        {
+            collapseMarks(from, lo, CHUNKSIZE, c, i);
+            ++from;
+            lo = 0;
+        }
+        collapseMarks(c, lo, i, c, i);
+    }
+
+    iterator after = length > n ? eraseSpan(c, i, length - n)
+                                : insertSpan(c, i, s + overlap, n - overlap);
+    reflow(after);
+    return after;
 }
 
-bool ChunkyString::operator<(const ChunkyString& rhs) const
+/// KMP failure function: entry k is the length of the longest proper
+/// border of pattern[0, k)
+static std::vector<size_t> borders(const std::string& pattern)
 {
-    return std::lexicographical_compare(this->begin(), this->end(),
-                                         rhs.begin(), rhs.end());
+    size_t m = pattern.size();
+    std::vector<size_t> fail(m + 1, 0);
+    for (size_t k = 2; k <= m; ++k)
+    {
+        size_t b = fail[k - 1];
+        while (b > 0 && pattern[b] != pattern[k - 1])
+        {
+            b = fail[b];
+        }
+        fail[k] = b + (pattern[b] == pattern[k - 1]);
+    }
+    return fail;
 }
 
-std::ostream& operator<<(std::ostream& out, 
-    const ChunkyString& text)
+/// Length of the longest prefix of pattern ending at c, given the one
+/// ending just before it (which may be all of pattern)
+static size_t extendMatch(const std::string& pattern, 
+                          const std::vector<size_t>& fail, size_t matched,
+                          char c)
 {
-    std::string toPrint = "";
-    for(ChunkyString::const_iterator i = text.begin(); i != text.end(); ++i)
+    if (matched == pattern.size())
     {
-        toPrint += *i;
+        matched = fail[matched];
     }
-    out << toPrint;
-    return out;
+    while (matched > 0 && pattern[matched] != c)
+    {
+        matched = fail[matched];
+    }
+    return matched + (pattern[matched] == c);
 }
 
-double ChunkyString::utilization() const
+size_t ChunkyString::replace_all(const std::string& pattern,
+                                 const std::string& replacement)
 {
-    return double(size_)/(chunks_.size()*CHUNKSIZE);
+    if (pattern.empty())
+    {
+        throw std::invalid_argument("replace_all: empty pattern");
+    }
+
+    // nothing is built, or allocated, unless something matches
+    size_t first = find(pattern);
+    if (first == npos)
+    {
+        return 0;
+    }
+    size_t m = pattern.size();
+    std::vector<size_t> fail = borders(pattern);
+    std::vector<MarkOffset> marks = liftMarks();
+
+    // the new list shares our pool, so it can be swapped in afterwards;
+    // the chunks before the one the first match starts in are moved to
+    // it whole
+    ChunkList result(chunks_.get_allocator());
+    size_t resultSize = 0;
+    size_t offset = 0;
+    ChunkList::iterator chunk = chunks_.begin();
+    while (offset + chunk->length_ <= first)
+    {
+        offset += chunk->length_;
+        resultSize += chunk->length_;
+        result.splice(result.end(), chunks_, chunk++);
+    }
+    auto emit = [&](const char* chars, size_t n) {
+        resultSize += n;
+        appendChars(result, chars, n);
+    };
+
+    // matched characters are held back until they can't be part of a
+    // match; no match starts before first, so matching can start afresh
+    // at this chunk
+    size_t matched = 0;
+    size_t count = 0;
+    std::vector<Span> matches;      // only kept for marks and the journal
+    for ( ; chunk != chunks_.end(); ++chunk)
+    {
+        for (size_t i = 0; i < chunk->length_; ++i, ++offset)
+        {
+            char c = chunk->chars_[i];
+            size_t next = extendMatch(pattern, fail, matched, c);
+
+            // of pattern[0, matched) + c, all but the last next characters
+            // are done with
+            size_t release = matched + 1 - next;
+            if (next == m)
+            {
+                release = matched + 1 - m;
+            }
+            emit(pattern.data(), std::min(release, matched));
+            if (release > matched)
+            {
+                emit(&c, 1);
+            }
+
+            if (next == m)
+            {
+                emit(replacement.data(), replacement.size());
+                ++count;
+                next = 0;
+                if (!marks.empty() || journal())
+                {
+                    matches.push_back(Span{offset + 1 - m, m, 
+                                           replacement.size()});
+                }
+            }
+            matched = next;
+        }
+    }
+    emit(pattern.data(), matched);
+
+    chunks_.swap(result);
+    size_ = resultSize;
+    changed();
+    restartCompaction();
+    remapMarks(marks, matches);
+    dropMarks(marks);
+
+    // recorded one after the other, so each offset includes the
+    // replacements before it
+    ptrdiff_t delta = 0;
+    for (size_t k = 0; journal() && k < matches.size(); ++k)
+    {
+        recordReplace(matches[k].offset_ + delta, pattern, replacement,
+                      k != 0);
+        delta += replacement.size() - m;
+    }
+    return count;
 }
 
-// ---------------------------------------------
-// Implementation of ChunkyString::Chunk
-// ---------------------------------------------
-//
-ChunkyString::Chunk::Chunk(size_t length, size_t CHUNKSIZE)
-    : length_{0}
+void ChunkyString::EditBatch::replace(size_t offset, size_t count,
+                                     const std::string& text)
 {
-    char chars_[CHUNKSIZE]; 
+    edits_.push_back(Edit{offset, count, text});
+}
+
+void ChunkyString::EditBatch::insert(size_t offset, const std::string& text)
+{
+    replace(offset, 0, text);
+}
+
+void ChunkyString::EditBatch::erase(size_t offset, size_t count)
+{
+    replace(offset, count, "");
+}
+
+size_t ChunkyString::EditBatch::size() const
+{
+    return edits_.size();
+}
+
+bool ChunkyString::EditBatch::empty() const
+{
+    return edits_.empty();
+}
+
+void ChunkyString::EditBatch::clear()
+{
+    edits_.clear();
+}
+
+void ChunkyString::apply(const EditBatch& batch)
+{
+    // check everything before changing anything
+    size_t end = 0;
+    for (const EditBatch::Edit& edit : batch.edits_)
+    {
+        if (edit.offset_ < end || edit.count_ > size_ 
+            || edit.offset_ > size_ - edit.count_)
+        {
+            throw std::invalid_argument(
+                "apply: edits out of order, overlapping or out of range");
+        }
+        end = edit.offset_ + edit.count_;
+    }
+    if (batch.empty())
+    {
+        return;
+    }
+
+    std::vector<MarkOffset> marks = liftMarks();
+
+    // untouched chunks are spliced from chunks_ into result; the rest are
+    // copied from, and freed along with what's left of chunks_
+    ChunkList result(chunks_.get_allocator());
+    ChunkList::iterator c = chunks_.begin();
+    size_t i = 0;       // index in *c
+    size_t pos = 0;     // offset of (c, i) in the old string
+    size_t newSize = size_;
+    std::string dropped;    // what the current edit removes, for the journal
+
+    // move past the old characters up to offset target, keeping them or
+    // not
+    auto moveTo = [&](size_t target, bool keep) {
+        while (pos < target)
+        {
+            if (i == 0 && pos + c->length_ <= target)
+            {
+                ChunkList::iterator next = std::next(c);
+                pos += c->length_;
+                if (!keep && journal())
+                {
+                    dropped.append(c->chars_, c->length_);
+                }
+                if (keep)
+                {
+                    // a chunk that fits in the last one is merged into it
+                    if (!result.empty() 
+                        && result.back().length_ + c->length_ <= CHUNKSIZE)
+                    {
+                        appendChars(result, c->chars_, c->length_);
+                    }
+                    else
+                    {
+                        result.splice(result.end(), chunks_, c);
+                    }
+                }
+                c = next;
+                continue;
+            }
+
+            size_t take = std::min(c->length_ - i, target - pos);
+            if (keep)
+            {
+                appendChars(result, c->chars_ + i, take);
+            }
+            else if (journal())
+            {
+                dropped.append(c->chars_ + i, take);
+            }
+            i += take;
+            pos += take;
+            if (i == c->length_)
+            {
+                ++c;
+                i = 0;
+            }
+        }
+    };
+
+    std::vector<std::string> removed;
+    for (const EditBatch::Edit& edit : batch.edits_)
+    {
+        moveTo(edit.offset_, true);
+        moveTo(edit.offset_ + edit.count_, false);
+        appendChars(result, edit.text_.data(), edit.text_.size());
+        newSize += edit.text_.size();
+        newSize -= edit.count_;
+        if (journal())
+        {
+            removed.push_back(std::move(dropped));
+            dropped.clear();
+        }
+    }
+    moveTo(size_, true);
+
+    chunks_.swap(result);
+    size_ = newSize;
+    changed();
+    restartCompaction();
+
+    if (!marks.empty())
+    {
+        std::vector<Span> edits;
+        for (const EditBatch::Edit& edit : batch.edits_)
+        {
+            edits.push_back(Span{edit.offset_, edit.count_, 
+                                 edit.text_.size()});
+        }
+        remapMarks(marks, edits);
+        dropMarks(marks);
+    }
+
+    // recorded one after the other, so each offset includes the edits
+    // before it
+    ptrdiff_t delta = 0;
+    for (size_t k = 0; journal() && k < removed.size(); ++k)
+    {
+        const EditBatch::Edit& edit = batch.edits_[k];
+        recordReplace(edit.offset_ + delta, std::move(removed[k]), 
+                      edit.text_, k != 0);
+        delta += edit.text_.size() - edit.count_;
+    }
+}
+
+void ChunkyString::set_reflow_policy(const ReflowPolicy& policy)
+{
+    extras().policy_ = policy;
+}
+
+const ChunkyString::ReflowPolicy& ChunkyString::reflow_policy() const
+{
+    return extras_ ? extras_->policy_ : DEFAULT_POLICY;
+}
+
+void ChunkyString::reflow(iterator& keep)
+{
+    const ReflowPolicy& policy = reflow_policy();
+    if (size_ != 0 && utilization() < policy.target_)
+    {
+        INSTRUMENT_OP(REFLOW);
+        stepCompaction(policy.chunksPerEdit_, &keep);
+    }
+}
+
+ChunkyString::iterator ChunkyString::eraseSpan(ChunkList::iterator c,
+                                               size_t i, size_t count)
+{
+    size_ -= count;
+    while (count > 0)
+    {
+        size_t take = std::min(c->length_ - i, count);
+        count -= take;
+        if (take == c->length_)
+        {
+            collapseMarks(c, 0, CHUNKSIZE, std::next(c), 0);
+            c = eraseChunk(c);
+            continue;
+        }
+
+        c->codepoints_ -= leadsIn(c->chars_ + i, take);
+        std::memmove(c->chars_ + i, c->chars_ + i + take, 
+                     c->length_ - i - take);
+        c->length_ -= take;
+        collapseMarks(c, i, i + take, c, i);
+        shiftMarks(c, i + take, CHUNKSIZE, c, -take);
+        if (i == c->length_)
+        {
+            shiftMarks(c, i, CHUNKSIZE, std::next(c), -i);
+            ++c;
+            i = 0;
+        }
+    }
+    iterator after(c, i, this);
+
+    // the cut is inside c, or between c and the chunk before it
+    ChunkList::iterator cut = c;
+    if (i == 0)
+    {
+        cut = c == chunks_.begin() ? chunks_.end() : std::prev(c);
+    }
+    if (cut != chunks_.end())
+    {
+        ChunkList::iterator next = std::next(cut);
+        if (next != chunks_.end() && cut->length_ + next->length_ <= CHUNKSIZE)
+        {
+            fillChunk(cut, &after);
+        }
+        else if (cut != chunks_.begin()
+                 && std::prev(cut)->length_ + cut->length_ <= CHUNKSIZE)
+        {
+            fillChunk(std::prev(cut), &after);
+        }
+    }
+    return after;
+}
+
+ChunkyString::iterator ChunkyString::insertSpan(ChunkList::iterator c, 
+                                                size_t i, const char* s, 
+                                                size_t n)
+{
+    if (n == 0)
+    {
+        return iterator(c, i, this);
+    }
+    size_ += n;
+
+    // at the start of a chunk, insert at the end of the one before instead
+    if (i == 0 && c != chunks_.begin())
+    {
+        --c;
+        i = c->length_;
+    }
+    else if (i == 0 && (c == chunks_.end() || c->length_ + n > CHUNKSIZE))
+    {
+        c = chunks_.insert(c, Chunk(0, CHUNKSIZE));
+    }
+
+    if (c->length_ + n <= CHUNKSIZE)
+    {
+        std::memmove(c->chars_ + i + n, c->chars_ + i, c->length_ - i);
+        std::memcpy(c->chars_ + i, s, n);
+        c->length_ += n;
+        c->codepoints_ += leadsIn(s, n);
+        shiftMarks(c, i, CHUNKSIZE, c, n);
+        return iterator(c, i + n, this);
+    }
+
+    // move what follows the insertion point to a chunk of its own
+    ChunkList::iterator tail = std::next(c);
+    if (i < c->length_)
+    {
+        INSTRUMENT_COUNT(SPLIT);
+        tail = chunks_.insert(tail, Chunk(0, CHUNKSIZE));
+        tail->length_ = c->length_ - i;
+        std::memcpy(tail->chars_, c->chars_ + i, tail->length_);
+        tail->codepoints_ = leadsIn(tail->chars_, tail->length_);
+        c->length_ = i;
+        c->codepoints_ -= tail->codepoints_;
+        shiftMarks(c, i, CHUNKSIZE, tail, -i);
+    }
+
+    // fill c, then as many new chunks as it takes
+    for (;;)
+    {
+        size_t take = std::min(CHUNKSIZE - c->length_, n);
+        std::memcpy(c->chars_ + c->length_, s, take);
+        c->length_ += take;
+        c->codepoints_ += leadsIn(s, take);
+        s += take;
+        n -= take;
+        if (n == 0)
+        {
+            break;
+        }
+        c = chunks_.insert(tail, Chunk(0, CHUNKSIZE));
+    }
+
+    iterator after(c, c->length_, this);
+    if (tail != chunks_.end() && c->length_ + tail->length_ <= CHUNKSIZE)
+    {
+        fillChunk(c, &after);
+    }
+    return after;
+}
+
+void ChunkyString::appendChars(ChunkList& list, const char* chars, 
+                               size_t n)
+{
+    while (n > 0)
+    {
+        if (list.empty() || list.back().length_ == CHUNKSIZE)
+        {
+            list.push_back(Chunk(0, CHUNKSIZE));
+        }
+        Chunk& back = list.back();
+        size_t take = std::min(CHUNKSIZE - back.length_, n);
+        std::memcpy(back.chars_ + back.length_, chars, take);
+        back.length_ += take;
+        back.codepoints_ += leadsIn(chars, take);
+        chars += take;
+        n -= take;
+    }
+}
+
+ChunkyString::ChunkList::iterator 
+    ChunkyString::eraseChunk(ChunkList::iterator c)
+{
+    // a compaction pass can't resume from a chunk that no longer exists
+    if (extras_ && extras_->compactAt_ == c)
+    {
+        extras_->compactAt_ = chunks_.end();
+    }
+    assert(!hasMarks() || extras_->marksIn_.count(&*c) == 0);
+    return chunks_.erase(c);
+}
+
+void ChunkyString::splitChunk(ChunkList::iterator c)
+{
+    INSTRUMENT_COUNT(SPLIT);
+    ChunkList::iterator back = chunks_.insert(std::next(c),
+                                              Chunk(0, CHUNKSIZE));
+    size_t keep = c->length_ / 2;
+    back->length_ = c->length_ - keep;
+    std::memcpy(back->chars_, c->chars_ + keep, back->length_);
+    c->length_ = keep;
+    back->codepoints_ = leadsIn(back->chars_, back->length_);
+    c->codepoints_ -= back->codepoints_;
+    shiftMarks(c, keep, CHUNKSIZE, back, -keep);
+}
+
+size_t ChunkyString::size() const
+{
+    return size_;
+}
+
+bool ChunkyString::operator==(const ChunkyString& rhs) const
+{
+    if(size_ != rhs.size_)
+    {
+        return false;
+    }
+
+    // cached hashes can settle it without looking at the characters
+    if(hashesDiffer(rhs))
+    {
+        return false;
+    }
+
+    // walk both chunk lists, comparing the overlap of the current chunks
+    ChunkList::const_iterator a = chunks_.begin();
+    ChunkList::const_iterator b = rhs.chunks_.begin();
+    size_t aInd = 0;
+    size_t bInd = 0;
+
+    while(a != chunks_.end())
+    {
+        size_t n = std::min(a->length_ - aInd, b->length_ - bInd);
+        if(std::memcmp(a->chars_ + aInd, b->chars_ + bInd, n) != 0)
+        {
+            return false;
+        }
+
+        aInd += n;
+        bInd += n;
+        if(aInd == a->length_)
+        {
+            ++a;
+            aInd = 0;
+        }
+        if(bInd == b->length_)
+        {
+            ++b;
+            bInd = 0;
+        }
+    }
+    return true;
+}
+
+bool ChunkyString::operator!=(const ChunkyString& rhs) const
+{
+    // Idiomatic code: leverage == to implement !=
+    return !(*this == rhs);
+}
+
+bool ChunkyString::operator<(const ChunkyString& rhs) const
+{
+    return std::lexicographical_compare(this->begin(), this->end(),
+                                         rhs.begin(), rhs.end());
+}
+
+size_t ChunkyString::threadsFor(size_t size, size_t threads)
+{
+    size_t most = size / PARALLEL_GRAIN;
+    if (most <= 1)
+    {
+        return 1;
+    }
+
+    // asking the system is a file read on Linux, so only do it once
+    static const size_t cores = 
+        std::max(1u, std::thread::hardware_concurrency());
+    return std::min(threads == 0 ? cores : threads, most);
+}
+
+std::vector<ChunkyString::Position> 
+    ChunkyString::positionsAt(const std::vector<size_t>& offsets) const
+{
+    std::vector<Position> positions;
+    positions.reserve(offsets.size());
+    ChunkList::const_iterator c = chunks_.begin();
+    size_t start = 0;       // offset of c's first character
+    for (size_t offset : offsets)
+    {
+        while (c != chunks_.end() && offset >= start + c->length_)
+        {
+            start += c->length_;
+            ++c;
+        }
+        positions.push_back(Position{c, c == chunks_.end() ? 0 
+                                                           : offset - start});
+    }
+    return positions;
+}
+
+size_t ChunkyString::mismatch(Position& a, Position& b, size_t n,
+                              const std::atomic<size_t>& earliest, 
+                              size_t limit)
+{
+    size_t done = 0;
+    while (done < n)
+    {
+        if (earliest.load(std::memory_order_relaxed) < limit)
+        {
+            return n;
+        }
+
+        // compare the overlap of the current chunks
+        size_t take = std::min(std::min(a.chunk_->length_ - a.index_,
+                                        b.chunk_->length_ - b.index_),
+                               n - done);
+        const char* x = a.chunk_->chars_ + a.index_;
+        const char* y = b.chunk_->chars_ + b.index_;
+        if (std::memcmp(x, y, take) != 0)
+        {
+            size_t skip = std::mismatch(x, x + take, y).first - x;
+            a.index_ += skip;
+            b.index_ += skip;
+            return done + skip;
+        }
+
+        done += take;
+        a.index_ += take;
+        b.index_ += take;
+        if (a.index_ == a.chunk_->length_)
+        {
+            ++a.chunk_;
+            a.index_ = 0;
+        }
+        if (b.index_ == b.chunk_->length_)
+        {
+            ++b.chunk_;
+            b.index_ = 0;
+        }
+    }
+    return n;
+}
+
+bool ChunkyString::parallel_equal(const ChunkyString& rhs, 
+                                  size_t threads) const
+{
+    if (size_ != rhs.size_)
+    {
+        return false;
+    }
+    if (hashesDiffer(rhs))
+    {
+        return false;
+    }
+
+    size_t parts = threadsFor(size_, threads);
+    if (parts == 1)
+    {
+        return *this == rhs;
+    }
+    std::vector<size_t> cuts;
+    for (size_t part = 0; part < parts; ++part)
+    {
+        cuts.push_back(size_ / parts * part);
+    }
+    std::vector<Position> mine = positionsAt(cuts);
+    std::vector<Position> theirs = rhs.positionsAt(cuts);
+    cuts.push_back(size_);
+
+    // any mismatch settles it, so every part stops at the first one
+    std::atomic<size_t> earliest(parts);
+    inParallel(parts, [&](size_t part) {
+        size_t n = cuts[part + 1] - cuts[part];
+        if (mismatch(mine[part], theirs[part], n, earliest, parts) < n)
+        {
+            lowerTo(earliest, part);
+        }
+    });
+    return earliest.load() == parts;
+}
+
+int ChunkyString::parallel_compare(const ChunkyString& rhs, 
+                                   size_t threads) const
+{
+    size_t common = std::min(size_, rhs.size_);
+    size_t parts = threadsFor(common, threads);
+    std::vector<size_t> cuts;
+    for (size_t part = 0; part < parts; ++part)
+    {
+        cuts.push_back(common / parts * part);
+    }
+    std::vector<Position> mine = positionsAt(cuts);
+    std::vector<Position> theirs = rhs.positionsAt(cuts);
+    cuts.push_back(common);
+
+    // a part only matters if no part before it differs
+    std::atomic<size_t> earliest(parts);
+    inParallel(parts, [&](size_t part) {
+        size_t n = cuts[part + 1] - cuts[part];
+        if (mismatch(mine[part], theirs[part], n, earliest, part) < n)
+        {
+            lowerTo(earliest, part);
+        }
+    });
+
+    size_t part = earliest.load();
+    if (part == parts)
+    {
+        return size_ < rhs.size_ ? -1 : size_ > rhs.size_ ? 1 : 0;
+    }
+    // mismatch() left the positions on the differing characters
+    char x = mine[part].chunk_->chars_[mine[part].index_];
+    char y = theirs[part].chunk_->chars_[theirs[part].index_];
+    return x < y ? -1 : 1;
+}
+
+size_t ChunkyString::find(const std::string& pattern, size_t from) const
+{
+    return parallel_find(pattern, from, 1);
+}
+
+size_t ChunkyString::count(const std::string& pattern) const
+{
+    return parallel_count(pattern, 1);
+}
+
+template <typename F>
+void ChunkyString::matchesFrom(Position p, size_t n, 
+                               const std::string& pattern,
+                               const std::vector<size_t>& fail,
+                               const std::atomic<size_t>& earliest,
+                               size_t limit, F found) const
+{
+    // a match starting in the last of the n characters ends m - 1 later
+    size_t scan = n + pattern.size() - 1;
+    size_t matched = 0;
+    size_t offset = 0;
+    for (ChunkList::const_iterator c = p.chunk_; c != chunks_.end(); ++c)
+    {
+        if (earliest.load(std::memory_order_relaxed) < limit)
+        {
+            return;
+        }
+        size_t last = std::min(c->length_, p.index_ + scan - offset);
+        for (size_t i = p.index_; i < last; )
+        {
+            // outside a partial match, skip to the next first letter
+            if (matched == 0)
+            {
+                const char* from = c->chars_ + i;
+                const void* hit = std::memchr(from, pattern[0], last - i);
+                size_t skip = hit == nullptr 
+                                  ? last - i 
+                                  : static_cast<const char*>(hit) - from;
+                i += skip;
+                offset += skip;
+                if (i == last)
+                {
+                    break;
+                }
+            }
+
+            matched = extendMatch(pattern, fail, matched, c->chars_[i]);
+            ++i;
+            ++offset;
+            if (matched == pattern.size() 
+                && !found(offset - pattern.size()))
+            {
+                return;
+            }
+        }
+        if (offset == scan)
+        {
+            return;
+        }
+        p.index_ = 0;
+    }
+}
+
+size_t ChunkyString::parallel_find(const std::string& pattern, size_t from,
+                                   size_t threads) const
+{
+    size_t m = pattern.size();
+    if (from > size_ || m > size_ - from)
+    {
+        return npos;
+    }
+    if (m == 0)
+    {
+        return from;
+    }
+
+    // each part looks for matches starting in its range
+    size_t starts = size_ - from - m + 1;
+    size_t parts = threadsFor(starts, threads);
+    std::vector<size_t> cuts;
+    for (size_t part = 0; part < parts; ++part)
+    {
+        cuts.push_back(from + starts / parts * part);
+    }
+    std::vector<Position> positions = positionsAt(cuts);
+    cuts.push_back(from + starts);
+
+    // parts after one with a match needn't go on
+    std::vector<size_t> fail = borders(pattern);
+    std::atomic<size_t> earliest(parts);
+    std::vector<size_t> found(parts, npos);
+    inParallel(parts, [&](size_t part) {
+        matchesFrom(positions[part], cuts[part + 1] - cuts[part], pattern,
+                    fail, earliest, part, [&](size_t offset) {
+                        found[part] = cuts[part] + offset;
+                        lowerTo(earliest, part);
+                        return false;
+                    });
+    });
+
+    size_t part = earliest.load();
+    return part == parts ? npos : found[part];
+}
+
+size_t ChunkyString::parallel_count(const std::string& pattern, 
+                                    size_t threads) const
+{
+    size_t m = pattern.size();
+    if (m == 0)
+    {
+        throw std::invalid_argument("count: empty pattern");
+    }
+    if (m > size_)
+    {
+        return 0;
+    }
+
+    size_t starts = size_ - m + 1;
+    size_t parts = threadsFor(starts, threads);
+    std::vector<size_t> cuts;
+    for (size_t part = 0; part < parts; ++part)
+    {
+        cuts.push_back(starts / parts * part);
+    }
+    std::vector<Position> positions = positionsAt(cuts);
+    cuts.push_back(starts);
+
+    std::vector<size_t> fail = borders(pattern);
+    std::atomic<size_t> never(0);
+    std::vector<size_t> counts(parts, 0);
+    inParallel(parts, [&](size_t part) {
+        size_t& count = counts[part];
+        matchesFrom(positions[part], cuts[part + 1] - cuts[part], pattern,
+                    fail, never, 0, [&count](size_t) {
+                        ++count;
+                        return true;
+                    });
+    });
+
+    size_t total = 0;
+    for (size_t count : counts)
+    {
+        total += count;
+    }
+    return total;
+}
+
+std::ostream& operator<<(std::ostream& out, 
+    const ChunkyString& text)
+{
+    std::string toPrint = "";
+    for(ChunkyString::const_iterator i = text.begin(); i != text.end(); ++i)
+    {
+        toPrint += *i;
+    }
+    out << toPrint;
+    return out;
+}
+
+double ChunkyString::utilization() const
+{
+    return double(size_)/(chunks_.size()*CHUNKSIZE);
+}
+
+void ChunkyString::translate(const char (&table)[256])
+{
+    for_each_chunk([&table](char* chars, size_t length) {
+        for (size_t i = 0; i < length; ++i)
+        {
+            chars[i] = table[static_cast<unsigned char>(chars[i])];
+        }
+    });
+}
+
+void ChunkyString::translate(const std::string& from, const std::string& to)
+{
+    if (to.empty())
+    {
+        throw std::invalid_argument("translate: empty replacement set");
+    }
+
+    char table[256];
+    for (size_t c = 0; c < 256; ++c)
+    {
+        table[c] = static_cast<char>(c);
+    }
+    for (size_t i = 0; i < from.size(); ++i)
+    {
+        table[static_cast<unsigned char>(from[i])] = 
+            to[std::min(i, to.size() - 1)];
+    }
+    translate(table);
+}
+
+bool ChunkyString::instrumented()
+{
+    return CHUNKYSTRING_INSTRUMENT;
+}
+
+const ChunkyString::OpCounters& ChunkyString::op_counters()
+{
+    return opCounters;
+}
+
+void ChunkyString::reset_op_counters()
+{
+    opCounters = OpCounters();
+}
+
+const char* ChunkyString::event_name(Event event)
+{
+    static const char* const NAMES[EVENTS] = {
+        "push_back", "insert", "erase", "reflow",
+        "split", "merge", "allocation"
+    };
+    return NAMES[event];
+}
+
+void ChunkyString::dump_op_counters(std::ostream& out, bool json)
+{
+    out << (json ? "{\"instrumented\": " : "instrumented: ")
+        << (instrumented() ? "true" : "false");
+
+    for (size_t e = 0; e < EVENTS; ++e)
+    {
+        Event event = static_cast<Event>(e);
+        if (json)
+        {
+            out << ", \"" << event_name(event) << "\": {\"count\": "
+                << opCounters.counts_[e];
+        }
+        else
+        {
+            out << std::endl << event_name(event) << ": "
+                << opCounters.counts_[e];
+        }
+
+        if (e > REFLOW)
+        {
+            out << (json ? "}" : "");
+            continue;
+        }
+
+        // only print buckets up to the last one in use
+        size_t used = LATENCY_BUCKETS;
+        while (used > 0 && opCounters.latencies_[e][used - 1] == 0)
+        {
+            --used;
+        }
+        out << (json ? ", \"latency_log2_ns\": [" : ", log2 ns:");
+        for (size_t b = 0; b < used; ++b)
+        {
+            out << (json && b > 0 ? ", " : json ? "" : " ")
+                << opCounters.latencies_[e][b];
+        }
+        out << (json ? "]}" : "");
+    }
+    out << (json ? "}" : "") << std::endl;
+}
+
+ChunkyString::ChunkStats ChunkyString::stats() const
+{
+    ChunkStats stats = ChunkStats();
+    size_t run = 0;
+
+    for (const Chunk& chunk : chunks_)
+    {
+        ++stats.chunks_;
+        ++stats.lengths_[chunk.length_];
+
+        if (2 * chunk.length_ < CHUNKSIZE)
+        {
+            ++stats.underfilled_;
+            if (run++ == 0)
+            {
+                ++stats.underfilledRuns_;
+            }
+            stats.longestUnderfilledRun_ = 
+                std::max(stats.longestUnderfilledRun_, run);
+        }
+        else
+        {
+            run = 0;
+        }
+    }
+    return stats;
+}
+
+std::ostream& operator<<(std::ostream& out, 
+                         const ChunkyString::ChunkStats& stats)
+{
+    out << stats.chunks_ << " chunks, " << stats.underfilled_
+        << " under-filled in " << stats.underfilledRuns_
+        << " runs (longest " << stats.longestUnderfilledRun_ << ")"
+        << std::endl << "lengths:";
+    for (size_t n = 1; n <= ChunkyString::CHUNKSIZE; ++n)
+    {
+        out << " " << n << ":" << stats.lengths_[n];
+    }
+    return out;
+}
+
+ChunkyString::MemoryUsage& 
+    ChunkyString::MemoryUsage::operator+=(const MemoryUsage& rhs)
+{
+    strings_ += rhs.strings_;
+    totalBytes_ += rhs.totalBytes_;
+    payloadBytes_ += rhs.payloadBytes_;
+    freeCells_ += rhs.freeCells_;
+    nodeOverheadBytes_ += rhs.nodeOverheadBytes_;
+    spareBytes_ += rhs.spareBytes_;
+    extrasBytes_ += rhs.extrasBytes_;
+    allocations_ += rhs.allocations_;
+    return *this;
+}
+
+ChunkyString::MemoryUsage ChunkyString::memory_usage() const
+{
+    // every chunk, inline or not, occupies one pool slot
+    const size_t slot = ChunkPoolType::SLOT_BYTES;
+
+    MemoryUsage usage;
+    usage.strings_ = 1;
+    usage.totalBytes_ = sizeof(ChunkyString) + pool_.heapBytes();
+    usage.payloadBytes_ = size_;
+    usage.freeCells_ = chunks_.size() * CHUNKSIZE - size_;
+    usage.nodeOverheadBytes_ = chunks_.size() * (slot - CHUNKSIZE);
+    usage.spareBytes_ = pool_.available() * slot;
+    usage.extrasBytes_ = 0;
+    usage.allocations_ = pool_.heapAllocations();
+    if (extras_)
+    {
+        extrasUsage(usage);
+        usage.totalBytes_ += usage.extrasBytes_;
+    }
+    return usage;
+}
+
+void ChunkyString::extrasUsage(MemoryUsage& usage) const
+{
+    usage.extrasBytes_ += sizeof(Extras);
+    ++usage.allocations_;
+
+    if (const Journal* journal = this->journal())
+    {
+        usage.extrasBytes_ += sizeof(Journal) + journal_bytes();
+        ++usage.allocations_;
+        for (const std::vector<Journal::Entry>* entries 
+                 : {&journal->undo_, &journal->redo_})
+        {
+            usage.allocations_ += entries->capacity() != 0;
+            for (const Journal::Entry& entry : *entries)
+            {
+                usage.allocations_ += onHeap(entry.erased_) 
+                                      + onHeap(entry.inserted_);
+            }
+        }
+    }
+
+    // one node per marked chunk, plus the bucket array
+    const auto& marksIn = extras_->marksIn_;
+    if (!marksIn.empty())
+    {
+        usage.extrasBytes_ += marksIn.bucket_count() * sizeof(void*);
+        usage.allocations_ += marksIn.bucket_count() > 1;
+        for (const auto& chunkMarks : marksIn)
+        {
+            size_t capacity = chunkMarks.second.capacity();
+            usage.extrasBytes_ += sizeof(void*) + sizeof(chunkMarks)
+                                  + capacity * sizeof(Mark*);
+            usage.allocations_ += 1 + (capacity != 0);
+        }
+    }
+
+    // the snapshot is shared with its readers, but it's only there
+    // because of this string
+    std::shared_ptr<const std::string> text = extras_->snapshot_.lock();
+    if (text)
+    {
+        // make_shared puts the string beside its reference counts
+        usage.extrasBytes_ += sizeof(*text) + 2 * sizeof(long) 
+                              + sizeof(void*);
+        ++usage.allocations_;
+        if (onHeap(*text))
+        {
+            usage.extrasBytes_ += text->capacity() + 1;
+            ++usage.allocations_;
+        }
+    }
+}
+
+ChunkyString::MemoryUsage ChunkyString::total_memory_usage()
+{
+    MemoryUsage total = MemoryUsage();
+    for (LiveShard& shard : liveShards_)
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+        for (const ChunkyString* s = shard.first_; s != nullptr; 
+             s = s->nextLive_)
+        {
+            total += s->memory_usage();
+        }
+    }
+    return total;
+}
+
+ChunkyString::LiveShard& ChunkyString::threadShard()
+{
+    static std::atomic<size_t> nextShard(0);
+    thread_local LiveShard* shard = 
+        &liveShards_[nextShard.fetch_add(1, std::memory_order_relaxed) 
+                     % LIVE_SHARDS];
+    return *shard;
+}
+
+void ChunkyString::registerLive()
+{
+    // a string made on one thread may be destroyed on another, so it
+    // remembers its shard
+    liveShard_ = &threadShard();
+    std::lock_guard<std::mutex> lock(liveShard_->mutex_);
+    prevLive_ = nullptr;
+    nextLive_ = liveShard_->first_;
+    if (nextLive_ != nullptr)
+    {
+        nextLive_->prevLive_ = this;
+    }
+    liveShard_->first_ = this;
+}
+
+void ChunkyString::unregisterLive()
+{
+    std::lock_guard<std::mutex> lock(liveShard_->mutex_);
+    if (prevLive_ != nullptr)
+    {
+        prevLive_->nextLive_ = nextLive_;
+    }
+    else
+    {
+        liveShard_->first_ = nextLive_;
+    }
+    if (nextLive_ != nullptr)
+    {
+        nextLive_->prevLive_ = prevLive_;
+    }
+}
+
+size_t ChunkyString::capacity() const
+{
+    size_t backFree = chunks_.empty() ? 0 : CHUNKSIZE - chunks_.back().length_;
+    return size_ + backFree + pool_.available() * CHUNKSIZE;
+}
+
+void ChunkyString::reserve(size_t n)
+{
+    // even with room enough, the pool is told to keep what it has
+    size_t have = capacity();
+    size_t chunks = n > have ? (n - have + CHUNKSIZE - 1) / CHUNKSIZE : 0;
+    pool_.reserve(pool_.available() + chunks);
+}
+
+void ChunkyString::shrink_to_fit()
+{
+    compact();
+    pool_.release();
+}
+
+void ChunkyString::compact()
+{
+    for (ChunkList::iterator dst = chunks_.begin(); dst != chunks_.end(); )
+    {
+        dst = fillChunk(dst, nullptr);
+    }
+    restartCompaction();
+}
+
+bool ChunkyString::compact_step(size_t budget)
+{
+    return stepCompaction(budget, nullptr);
+}
+
+bool ChunkyString::stepCompaction(size_t budget, iterator* keep)
+{
+    ChunkList::iterator& compactAt = extras().compactAt_;
+    if (compactAt == chunks_.end())
+    {
+        compactAt = chunks_.begin();
+    }
+
+    for ( ; budget > 0 && compactAt != chunks_.end(); --budget)
+    {
+        compactAt = fillChunk(compactAt, keep);
+    }
+    return compactAt == chunks_.end();
+}
+
+ChunkyString::ChunkList::iterator 
+    ChunkyString::fillChunk(ChunkList::iterator dst, iterator* keep)
+{
+    ChunkList::iterator src = std::next(dst);
+
+    while (dst->length_ < CHUNKSIZE && src != chunks_.end())
+    {
+        // move as much of src's front as fits onto dst's end
+        size_t n = std::min(CHUNKSIZE - dst->length_, src->length_);
+        size_t leads = leadsIn(src->chars_, n);
+        std::memcpy(dst->chars_ + dst->length_, src->chars_, n);
+        std::memmove(src->chars_, src->chars_ + n, src->length_ - n);
+
+        bool keepMoved = keep != nullptr && keep->chunk_ == src;
+        size_t keepIndex = keepMoved ? keep->index() : 0;
+        shiftMarks(src, 0, n, dst, dst->length_);
+        shiftMarks(src, n, CHUNKSIZE, src, -n);
+
+        dst->length_ += n;
+        src->length_ -= n;
+        dst->codepoints_ += leads;
+        src->codepoints_ -= leads;
+
+        if (keepMoved)
+        {
+            *keep = keepIndex < n 
+                        ? iterator(dst, dst->length_ - n + keepIndex, this)
+                        : iterator(src, keepIndex - n, this);
+        }
+
+        if (src->length_ == 0)
+        {
+            INSTRUMENT_COUNT(MERGE);
+            src = eraseChunk(src);
+        }
+    }
+    return std::next(dst);
+}
+
+void ChunkyString::enable_journal()
+{
+    if (!journal())
+    {
+        extras().journal_.reset(new Journal());
+    }
+}
+
+void ChunkyString::disable_journal()
+{
+    if (extras_)
+    {
+        extras_->journal_.reset();
+    }
+}
+
+bool ChunkyString::journaling() const
+{
+    return journal() != nullptr;
+}
+
+bool ChunkyString::can_undo() const
+{
+    return journal() && !journal()->undo_.empty();
+}
+
+bool ChunkyString::can_redo() const
+{
+    return journal() && !journal()->redo_.empty();
+}
+
+void ChunkyString::end_undo_step()
+{
+    if (journal())
+    {
+        journal()->open_ = false;
+    }
+}
+
+size_t ChunkyString::journal_bytes() const
+{
+    const Journal* journal = this->journal();
+    if (!journal)
+    {
+        return 0;
+    }
+
+    size_t bytes = 0;
+    for (const std::vector<Journal::Entry>* entries 
+             : {&journal->undo_, &journal->redo_})
+    {
+        for (const Journal::Entry& entry : *entries)
+        {
+            bytes += entry.erased_.capacity() + entry.inserted_.capacity();
+        }
+        bytes += entries->capacity() * sizeof(Journal::Entry);
+    }
+    return bytes;
+}
+
+bool ChunkyString::undo()
+{
+    if (!can_undo())
+    {
+        return false;
+    }
+
+    // replaying an edit mustn't record it again
+    std::unique_ptr<Journal> journal = std::move(extras_->journal_);
+    std::vector<Journal::Entry>& entries = journal->undo_;
+    size_t start = Journal::stepStart(entries);
+    try
+    {
+        for (size_t k = entries.size(); k > start; --k)
+        {
+            const Journal::Entry& entry = entries[k - 1];
+            iterator first = iterator_at(entry.offset_);
+            replace(first, std::next(first, entry.inserted_.size()), 
+                    entry.erased_.data(), entry.erased_.size());
+        }
+    }
+    catch (...)
+    {
+        extras_->journal_ = std::move(journal);
+        throw;
+    }
+
+    std::move(entries.begin() + start, entries.end(), 
+              std::back_inserter(journal->redo_));
+    entries.erase(entries.begin() + start, entries.end());
+    journal->open_ = false;
+    extras_->journal_ = std::move(journal);
+    return true;
+}
+
+bool ChunkyString::redo()
+{
+    if (!can_redo())
+    {
+        return false;
+    }
+
+    std::unique_ptr<Journal> journal = std::move(extras_->journal_);
+    std::vector<Journal::Entry>& entries = journal->redo_;
+    size_t start = Journal::stepStart(entries);
+    try
+    {
+        for (size_t k = start; k < entries.size(); ++k)
+        {
+            const Journal::Entry& entry = entries[k];
+            iterator first = iterator_at(entry.offset_);
+            replace(first, std::next(first, entry.erased_.size()), 
+                    entry.inserted_.data(), entry.inserted_.size());
+        }
+    }
+    catch (...)
+    {
+        extras_->journal_ = std::move(journal);
+        throw;
+    }
+
+    std::move(entries.begin() + start, entries.end(), 
+              std::back_inserter(journal->undo_));
+    entries.erase(entries.begin() + start, entries.end());
+    journal->open_ = false;
+    extras_->journal_ = std::move(journal);
+    return true;
+}
+
+void ChunkyString::recordInsert(size_t offset, char c)
+{
+    Journal& journal = *this->journal();
+    journal.redo_.clear();
+    if (journal.open_)
+    {
+        // typing continues an insert run
+        Journal::Entry& last = journal.undo_.back();
+        if (last.erased_.empty() 
+            && offset == last.offset_ + last.inserted_.size())
+        {
+            last.inserted_.push_back(c);
+            return;
+        }
+    }
+    journal.undo_.push_back(Journal::Entry{offset, std::string(), 
+                                           std::string(1, c), false});
+    journal.open_ = true;
+}
+
+void ChunkyString::recordErase(size_t offset, char c)
+{
+    Journal& journal = *this->journal();
+    journal.redo_.clear();
+    if (journal.open_)
+    {
+        Journal::Entry& last = journal.undo_.back();
+        if (!last.inserted_.empty() && last.erased_.empty()
+            && offset + 1 == last.offset_ + last.inserted_.size())
+        {
+            // backspacing over what was just typed takes it back out
+            last.inserted_.pop_back();
+            if (last.inserted_.empty())
+            {
+                journal.undo_.pop_back();
+                journal.open_ = false;
+            }
+            return;
+        }
+        if (last.inserted_.empty() && offset == last.offset_)
+        {
+            // forward delete
+            last.erased_.push_back(c);
+            return;
+        }
+        if (last.inserted_.empty() && offset + 1 == last.offset_)
+        {
+            // backspace
+            last.erased_.insert(last.erased_.begin(), c);
+            last.offset_ = offset;
+            return;
+        }
+    }
+    journal.undo_.push_back(Journal::Entry{offset, std::string(1, c), 
+                                           std::string(), false});
+    journal.open_ = true;
+}
+
+void ChunkyString::recordReplace(size_t offset, std::string erased,
+                                 std::string inserted, bool chained)
+{
+    Journal& journal = *this->journal();
+    journal.redo_.clear();
+    journal.undo_.push_back(Journal::Entry{offset, std::move(erased), 
+                                           std::move(inserted), chained});
+    journal.open_ = false;
+}
+
+size_t ChunkyString::offsetOf(const_iterator i) const
+{
+    if (i.cur_ == nullptr)
+    {
+        return size_;
+    }
+
+    size_t offset = i.index();
+    for (ChunkList::const_iterator c = chunks_.begin(); c != i.chunk_; ++c)
+    {
+        offset += c->length_;
+    }
+    return offset;
+}
+
+ChunkyString::iterator ChunkyString::iterator_at(size_t offset)
+{
+    for (ChunkList::iterator c = chunks_.begin(); c != chunks_.end(); ++c)
+    {
+        if (offset < c->length_)
+        {
+            return iterator(c, offset, this);
+        }
+        offset -= c->length_;
+    }
+    return end();
+}
+
+const ChunkyString::Chunk* 
+    ChunkyString::markKey(ChunkList::const_iterator c) const
+{
+    return c == chunks_.end() ? nullptr : &*c;
+}
+
+void ChunkyString::placeMark(Mark* mark, ChunkList::iterator c, size_t i)
+{
+    // one past a chunk's last character is the next chunk's first
+    if (c != chunks_.end() && i == c->length_)
+    {
+        ++c;
+        i = 0;
+    }
+    mark->owner_ = this;
+    mark->chunk_ = c;
+    mark->index_ = c == chunks_.end() ? 0 : i;
+    extras().marksIn_[markKey(c)].push_back(mark);
+}
+
+void ChunkyString::unplaceMark(Mark* mark)
+{
+    const Chunk* key = markKey(mark->chunk_);
+    std::vector<Mark*>& marks = extras_->marksIn_[key];
+    *std::find(marks.begin(), marks.end(), mark) = marks.back();
+    marks.pop_back();
+    if (marks.empty())
+    {
+        extras_->marksIn_.erase(key);
+    }
+}
+
+void ChunkyString::shiftMarks(ChunkList::iterator from, size_t lo, 
+                              size_t hi, ChunkList::iterator to,
+                              ptrdiff_t delta)
+{
+    if (!hasMarks())
+    {
+        return;
+    }
+    const Chunk* key = markKey(from);
+    auto found = extras_->marksIn_.find(key);
+    if (found == extras_->marksIn_.end())
+    {
+        return;
+    }
+
+    // references to map values survive rehashing, iterators don't
+    std::vector<Mark*>& marks = found->second;
+    for (size_t k = 0; k < marks.size(); )
+    {
+        Mark* mark = marks[k];
+        if (mark->index_ < lo || mark->index_ >= hi)
+        {
+            ++k;
+        }
+        else if (to == from)
+        {
+            mark->index_ += delta;
+            ++k;
+        }
+        else
+        {
+            marks[k] = marks.back();
+            marks.pop_back();
+            mark->chunk_ = to;
+            mark->index_ = to == chunks_.end() ? 0 : mark->index_ + delta;
+            extras_->marksIn_[markKey(to)].push_back(mark);
+        }
+    }
+    if (marks.empty())
+    {
+        extras_->marksIn_.erase(key);
+    }
+}
+
+void ChunkyString::collapseMarks(ChunkList::iterator from, size_t lo,
+                                 size_t hi, ChunkList::iterator to, size_t i)
+{
+    if (!hasMarks())
+    {
+        return;
+    }
+    const Chunk* key = markKey(from);
+    auto found = extras_->marksIn_.find(key);
+    if (found == extras_->marksIn_.end())
+    {
+        return;
+    }
+
+    std::vector<Mark*>& marks = found->second;
+    for (size_t k = 0; k < marks.size(); )
+    {
+        Mark* mark = marks[k];
+        if (mark->index_ < lo || mark->index_ >= hi)
+        {
+            ++k;
+        }
+        else if (to == from)
+        {
+            mark->index_ = i;
+            ++k;
+        }
+        else
+        {
+            marks[k] = marks.back();
+            marks.pop_back();
+            mark->chunk_ = to;
+            mark->index_ = to == chunks_.end() ? 0 : i;
+            extras_->marksIn_[markKey(to)].push_back(mark);
+        }
+    }
+    if (marks.empty())
+    {
+        extras_->marksIn_.erase(key);
+    }
+}
+
+std::vector<ChunkyString::MarkOffset> ChunkyString::liftMarks()
+{
+    std::vector<MarkOffset> marks;
+    if (!hasMarks())
+    {
+        return marks;
+    }
+
+    size_t offset = 0;
+    for (const Chunk& chunk : chunks_)
+    {
+        auto found = extras_->marksIn_.find(&chunk);
+        if (found != extras_->marksIn_.end())
+        {
+            for (Mark* mark : found->second)
+            {
+                marks.push_back(MarkOffset(offset + mark->index_, mark));
+            }
+        }
+        offset += chunk.length_;
+    }
+    auto atEnd = extras_->marksIn_.find(nullptr);
+    if (atEnd != extras_->marksIn_.end())
+    {
+        for (Mark* mark : atEnd->second)
+        {
+            marks.push_back(MarkOffset(size_, mark));
+        }
+    }
+    extras_->marksIn_.clear();
+
+    std::sort(marks.begin(), marks.end());
+    return marks;
+}
+
+void ChunkyString::dropMarks(std::vector<MarkOffset>& marks)
+{
+    std::sort(marks.begin(), marks.end());
+
+    ChunkList::iterator c = chunks_.begin();
+    size_t start = 0;       // offset of c's first character
+    for (MarkOffset& mark : marks)
+    {
+        while (c != chunks_.end() && mark.first >= start + c->length_)
+        {
+            start += c->length_;
+            ++c;
+        }
+        placeMark(mark.second, c, c == chunks_.end() ? 0 
+                                                     : mark.first - start);
+    }
+}
+
+void ChunkyString::remapMarks(std::vector<MarkOffset>& marks,
+                              const std::vector<Span>& edits)
+{
+    // marks are sorted by offset, so one walk over the edits will do
+    size_t e = 0;
+    ptrdiff_t delta = 0;
+    for (MarkOffset& mark : marks)
+    {
+        // edits ending at or before the mark just move it
+        while (e < edits.size() 
+               && edits[e].offset_ + edits[e].count_ <= mark.first)
+        {
+            delta += edits[e].length_ - edits[e].count_;
+            ++e;
+        }
+
+        // a mark on a replaced character goes to the one after the
+        // replacement
+        if (e < edits.size() && edits[e].offset_ <= mark.first)
+        {
+            mark.first = edits[e].offset_ + edits[e].length_ + delta;
+        }
+        else
+        {
+            mark.first += delta;
+        }
+    }
+}
+
+ChunkyString::Mark::Mark()
+    : owner_{nullptr}, index_{0}
+{
+    // Nothing to do here!
+}
+
+ChunkyString::Mark::Mark(ChunkyString& text, const_iterator position)
+    : owner_{nullptr}, index_{0}
+{
+    // erasing nothing turns a list const_iterator into an iterator
+    ChunkList::iterator c = text.chunks_.erase(position.chunk_,
+                                               position.chunk_);
+    text.placeMark(this, c, position.cur_ == nullptr ? 0 : position.index());
+}
+
+ChunkyString::Mark::Mark(const Mark& other)
+    : owner_{nullptr}, index_{0}
+{
+    if (other.owner_ != nullptr)
+    {
+        other.owner_->placeMark(this, other.chunk_, other.index_);
+    }
+}
+
+ChunkyString::Mark& ChunkyString::Mark::operator=(const Mark& other)
+{
+    if (this != &other)
+    {
+        if (owner_ != nullptr)
+        {
+            owner_->unplaceMark(this);
+            owner_ = nullptr;
+        }
+        if (other.owner_ != nullptr)
+        {
+            other.owner_->placeMark(this, other.chunk_, other.index_);
+        }
+    }
+    return *this;
+}
+
+ChunkyString::Mark::~Mark()
+{
+    if (owner_ != nullptr)
+    {
+        owner_->unplaceMark(this);
+    }
+}
+
+bool ChunkyString::Mark::attached() const
+{
+    return owner_ != nullptr;
+}
+
+ChunkyString::iterator ChunkyString::Mark::position() const
+{
+    return iterator(chunk_, index_, owner_);
+}
+
+size_t ChunkyString::Mark::offset() const
+{
+    return owner_->offsetOf(position());
+}
+
+void ChunkyString::Mark::move_to(const_iterator position)
+{
+    ChunkyString& text = *owner_;
+    text.unplaceMark(this);
+    ChunkList::iterator c = text.chunks_.erase(position.chunk_,
+                                               position.chunk_);
+    text.placeMark(this, c, position.cur_ == nullptr ? 0 : position.index());
+}
+
+void ChunkyString::recount(Chunk& chunk)
+{
+    chunk.codepoints_ = leadsIn(chunk.chars_, chunk.length_);
+}
+
+size_t ChunkyString::leadIndex(const Chunk& chunk, size_t n)
+{
+    // caller guarantees the chunk has more than n lead bytes
+    size_t i = 0;
+    for ( ; ; ++i)
+    {
+        if (isLead(chunk.chars_[i]))
+        {
+            if (n == 0)
+            {
+                break;
+            }
+            --n;
+        }
+    }
+    return i;
+}
+
+size_t ChunkyString::codepoints() const
+{
+    size_t count = 0;
+    for (const Chunk& chunk : chunks_)
+    {
+        count += chunk.codepoints_;
+    }
+    return count;
+}
+
+ChunkyString::iterator ChunkyString::codepoint_at(size_t n)
+{
+    // skip whole chunks until we reach the one holding code point n
+    for (ChunkList::iterator c = chunks_.begin(); c != chunks_.end();
+         ++c)
+    {
+        size_t count = c->codepoints_;
+        if (n < count)
+        {
+            return iterator(c, leadIndex(*c, n), this);
+        }
+        n -= count;
+    }
+    return end();
+}
+
+ChunkyString::const_iterator ChunkyString::codepoint_at(size_t n) const
+{
+    for (ChunkList::const_iterator c = chunks_.begin();
+         c != chunks_.end(); ++c)
+    {
+        size_t count = c->codepoints_;
+        if (n < count)
+        {
+            return const_iterator(c, leadIndex(*c, n), this);
+        }
+        n -= count;
+    }
+    return end();
+}
+
+ChunkyString::codepoint_iterator ChunkyString::begin_codepoints() const
+{
+    // stray continuation bytes at the very start don't begin a code point
+    const_iterator i = begin();
+    while (i != end() && !isLead(*i))
+    {
+        ++i;
+    }
+    return CodepointIterator(i, end());
+}
+
+ChunkyString::codepoint_iterator ChunkyString::end_codepoints() const
+{
+    return CodepointIterator(end(), end());
+}
+
+bool ChunkyString::valid_utf8() const
+{
+    // continuation bytes still owed by the current sequence, and the range
+    // the next one must fall in; sequences may continue into the next chunk
+    int need = 0;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+
+    for (const Chunk& chunk : chunks_)
+    {
+        const unsigned char* p = 
+            reinterpret_cast<const unsigned char*>(chunk.chars_);
+        const unsigned char* last = p + chunk.length_;
+
+        while (p != last)
+        {
+            if (need == 0)
+            {
+                // skip runs of ASCII a word at a time
+                while (last - p >= 8 && isAscii8(p))
+                {
+                    p += 8;
+                }
+                if (p == last)
+                {
+                    break;
+                }
+                need = leadLength(*p++, lo, hi);
+                if (need < 0)
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                if (*p < lo || *p > hi)
+                {
+                    return false;
+                }
+                ++p;
+                lo = 0x80;
+                hi = 0xBF;
+                --need;
+            }
+        }
+    }
+    return need == 0;
+}
+
+// ---------------------------------------------
+// Hashing
+// ---------------------------------------------
+//
+// Primes from xxHash64.
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+
+/**
+ * \brief Incremental hash over a sequence of character spans
+ *
+ * \details Bytes are gathered into 64-bit words, carrying partial words
+ *          from one span to the next, so the result depends only on the
+ *          concatenated bytes and not on where the spans were split.
+ */
+class StreamHasher {
+public:
+    StreamHasher()
+        : acc_{PRIME3}, pending_{0}, pendingLength_{0}, length_{0}
+    {
+        // Nothing to do here!
+    }
+
+    /// Feed the next n bytes starting at chars.
+    void update(const char* chars, size_t n)
+    {
+        length_ += n;
+
+        // top up a word left over from the previous span
+        while (pendingLength_ != 0 && n != 0)
+        {
+            pending_ |= uint64_t(static_cast<unsigned char>(*chars++))
+                        << (8 * pendingLength_);
+            --n;
+            if (++pendingLength_ == 8)
+            {
+                round(pending_);
+                pending_ = 0;
+                pendingLength_ = 0;
+            }
+        }
+
+        for ( ; n >= 8; n -= 8, chars += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, chars, sizeof(word));
+            round(word);
+        }
+
+        for ( ; n != 0; --n)
+        {
+            pending_ |= uint64_t(static_cast<unsigned char>(*chars++))
+                        << (8 * pendingLength_++);
+        }
+    }
+
+    /// Fold in the unfinished word and the length, and mix thoroughly.
+    uint64_t digest() const
+    {
+        uint64_t h = acc_ ^ (pending_ * PRIME1) ^ (length_ * PRIME2);
+        h ^= h >> 33;
+        h *= PRIME2;
+        h ^= h >> 29;
+        h *= PRIME3;
+        h ^= h >> 32;
+        return h;
+    }
+
+private:
+    void round(uint64_t word)
+    {
+        acc_ ^= word * PRIME2;
+        acc_ = (acc_ << 31) | (acc_ >> 33);
+        acc_ *= PRIME1;
+    }
+
+    uint64_t acc_;
+    uint64_t pending_;        // bytes not yet forming a whole word
+    size_t pendingLength_;
+    uint64_t length_;
+};
+
+void ChunkyString::changed()
+{
+    hash_.store(UNHASHED, std::memory_order_relaxed);
+    if (extras_)
+    {
+        extras_->snapshot_.reset();
+    }
+}
+
+size_t ChunkyString::hash() const
+{
+    // relaxed is enough: the value is all a reader needs, and whoever
+    // computed it read the same characters
+    size_t hash = hash_.load(std::memory_order_relaxed);
+    if (hash == UNHASHED)
+    {
+        StreamHasher hasher;
+        for (const Chunk& chunk : chunks_)
+        {
+            hasher.update(chunk.chars_, chunk.length_);
+        }
+        hash = size_t(hasher.digest());
+        if (hash == UNHASHED)
+        {
+            // that value means "not computed", so it goes to a neighbour
+            hash = UNHASHED + 1;
+        }
+        hash_.store(hash, std::memory_order_relaxed);
+    }
+    return hash;
+}
+
+bool ChunkyString::hashesDiffer(const ChunkyString& rhs) const
+{
+    size_t mine = hash_.load(std::memory_order_relaxed);
+    size_t theirs = rhs.hash_.load(std::memory_order_relaxed);
+    return mine != UNHASHED && theirs != UNHASHED && mine != theirs;
+}
+
+ChunkyString::Snapshot ChunkyString::snapshot()
+{
+    // every modification forgets the cached copy, so one that is still
+    // alive is current
+    std::shared_ptr<const std::string> text = extras().snapshot_.lock();
+    if (!text)
+    {
+        std::string copy;
+        copy.reserve(size_);
+        for (const Chunk& chunk : chunks_)
+        {
+            copy.append(chunk.chars_, chunk.length_);
+        }
+        text = std::make_shared<const std::string>(std::move(copy));
+        extras_->snapshot_ = text;
+    }
+    return Snapshot(text);
+}
+
+ChunkyString::Snapshot::Snapshot()
+{
+    // Nothing to do here!
+}
+
+ChunkyString::Snapshot::Snapshot(std::shared_ptr<const std::string> text)
+    : text_{std::move(text)}
+{
+    // Nothing to do here!
+}
+
+size_t ChunkyString::Snapshot::size() const
+{
+    return text_ ? text_->size() : 0;
+}
+
+bool ChunkyString::Snapshot::empty() const
+{
+    return size() == 0;
+}
+
+const char* ChunkyString::Snapshot::data() const
+{
+    return text_ ? text_->data() : nullptr;
+}
+
+const char* ChunkyString::Snapshot::begin() const
+{
+    return data();
+}
+
+const char* ChunkyString::Snapshot::end() const
+{
+    return data() + size();
+}
+
+char ChunkyString::Snapshot::operator[](size_t offset) const
+{
+    return (*text_)[offset];
+}
+
+// ---------------------------------------------
+// Implementation of ChunkyString::Chunk
+// ---------------------------------------------
+//
+ChunkyString::Chunk::Chunk(size_t length, size_t CHUNKSIZE)
+    : length_{0}, codepoints_{0}
+{
+    char chars_[CHUNKSIZE]; 
+}
+
+// ---------------------------------------------
+// Implementation of ChunkyString::CharReference
+// ---------------------------------------------
+//
+ChunkyString::CharReference& ChunkyString::CharReference::operator=(char c)
+{
+    chunk_->codepoints_ -= isLead(*char_);
+    chunk_->codepoints_ += isLead(c);
+    *char_ = c;
+    owner_->changed();
+    return *this;
+}
+
+// ---------------------------------------------
+// Implementation of ChunkyString::CodepointIterator
+// ---------------------------------------------
+//
+ChunkyString::CodepointIterator::CodepointIterator()
+{
+    // Nothing to do here..
+}
+
+ChunkyString::CodepointIterator::CodepointIterator(const_iterator pos,
+                                                   const_iterator end)
+    : pos_{pos}, end_{end}
+{
+    // Nothing to do here!
+}
+
+ChunkyString::CodepointIterator& ChunkyString::CodepointIterator::operator++()
+{
+    // move past the lead byte and every continuation byte after it
+    ++pos_;
+    while (pos_ != end_ && !isLead(*pos_))
+    {
+        ++pos_;
+    }
+    return *this;
+}
+
+char32_t ChunkyString::CodepointIterator::operator*() const
+{
+    const char32_t REPLACEMENT = 0xFFFD;
+
+    unsigned char lo;
+    unsigned char hi;
+    unsigned char lead = *pos_;
+    int need = leadLength(lead, lo, hi);
+    if (need < 0)
+    {
+        return REPLACEMENT;
+    }
+
+    // the lead byte carries the top bits of the code point
+    char32_t codepoint = lead & (need == 0 ? 0x7F : 0x7F >> (need + 1));
+    const_iterator i = pos_;
+    for ( ; need > 0; --need)
+    {
+        ++i;
+        if (i == end_)
+        {
+            return REPLACEMENT;
+        }
+        unsigned char next = *i;
+        if (next < lo || next > hi)
+        {
+            return REPLACEMENT;
+        }
+        codepoint = (codepoint << 6) | (next & 0x3F);
+        lo = 0x80;
+        hi = 0xBF;
+    }
+
+    // leftover continuation bytes make the whole group malformed
+    ++i;
+    if (i != end_ && !isLead(*i))
+    {
+        return REPLACEMENT;
+    }
+    return codepoint;
+}
+
+bool ChunkyString::CodepointIterator::operator==(
+    const CodepointIterator& rhs) const
+{
+    return pos_ == rhs.pos_;
+}
+
+bool ChunkyString::CodepointIterator::operator!=(
+    const CodepointIterator& rhs) const
+{
+    return !(*this == rhs);
+}
+
+ChunkyString::const_iterator ChunkyString::CodepointIterator::base() const
+{
+    return pos_;
 }
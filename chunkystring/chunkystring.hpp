@@ -10,11 +10,17 @@
 #define CHUNKYSTRING_HPP_INCLUDED 1
 
 #include <cstddef>
+#include <cstdint>
 #include <string>
+#include <atomic>
 #include <list>
+#include <memory>
 #include <iterator>
 #include <iostream>
 #include <type_traits>
+#include <vector>
+
+#include "chunkpool.hpp"
 
 /**
  * \class ChunkyString
@@ -33,6 +39,7 @@ class ChunkyString {
     // Forward declaration of private class.
     template <bool const_iter>
     class Iterator;
+    class CodepointIterator;
 
 public:
     // Standard STL container type definitions
@@ -44,23 +51,76 @@ public:
 
     using iterator = Iterator<false>;
     using const_iterator = Iterator<true>;
+    using codepoint_iterator = CodepointIterator;
+
+    class Mark;
 
     // reverse_iterator and const_reverse_iterator aren't supported
 
+    /**
+     * \struct ReflowPolicy
+     * \brief How hard insert and erase work to keep chunks full.
+     *
+     * \details Whenever an insert or erase leaves utilization() below
+     *          target_, the edit also continues the compact_step() pass by
+     *          chunksPerEdit_ chunks. Repacking is thus spread over many
+     *          edits instead of stalling one of them, and the time any
+     *          single edit spends repacking stays bounded.
+     */
+    struct ReflowPolicy {
+        double target_;          ///< repack while utilization is below this
+        size_t chunksPerEdit_;   ///< chunks to fill per edit while repacking
+    };
+
+    /**
+     * \struct MemoryUsage
+     * \brief Where the memory of one or more ChunkyStrings goes.
+     *
+     * \details totalBytes_ is everything: the ChunkyString objects
+     *          (including their inline chunks) plus what they got from
+     *          `operator new`. The other byte counts are parts of it;
+     *          what's left over is fixed per-object bookkeeping. Heap
+     *          allocator headers are not visible to us and not counted.
+     *
+     *          extrasBytes_ covers marks, the undo journal and the cached
+     *          snapshot. The nodes and buffers of the standard containers
+     *          behind them are estimated from their sizes and capacities.
+     */
+    struct MemoryUsage {
+        size_t strings_;           ///< live ChunkyStrings counted
+        size_t totalBytes_;        ///< objects plus heap memory
+        size_t payloadBytes_;      ///< characters stored
+        size_t freeCells_;         ///< unused character cells in chunks
+        size_t nodeOverheadBytes_; ///< per-chunk links, lengths, padding
+        size_t spareBytes_;        ///< chunks set aside but not in use
+        size_t extrasBytes_;       ///< marks, journal, cached snapshot
+        size_t allocations_;       ///< live heap allocations
+
+        /// Add in another string's (or set of strings') usage
+        MemoryUsage& operator+=(const MemoryUsage& rhs);
+    };
+
     /**
      * \brief Default constructor
      *
-     * \note constant time
+     * \note constant time; never allocates
      */
     ChunkyString();
 
-    ~ChunkyString() = default;
+    ~ChunkyString();
 
     /**
      * \brief Copy constructor
      */
     ChunkyString(const ChunkyString& orig);
 
+    /**
+     * \brief Copy assignment
+     *
+     * \details Reuses this string's existing chunks where it can.
+     */
+    ChunkyString& operator=(const ChunkyString& rhs);
+
     /// Return an iterator to the first character in the ChunkyString.
     iterator begin();
     /// Return an iterator to "one past the end"
@@ -71,6 +131,11 @@ public:
     /// Return a const iterator to "one past the end"
     const_iterator end() const;
 
+    /// Return a code-point iterator to the first UTF-8 code point.
+    codepoint_iterator begin_codepoints() const;
+    /// Return a code-point iterator to "one past the end"
+    codepoint_iterator end_codepoints() const;
+
     /**
      * \brief Inserts a character at the end of the ChunkyString.
      *
@@ -80,18 +145,282 @@ public:
      */
     void push_back(char c);
 
+    /**
+     * \brief Replace the contents with the n characters at chars, built
+     *        on several threads
+     * \details
+     *   Every chunk but the last comes out full. The chunks are
+     *   allocated up front on this thread, from a single block, since the
+     *   pool isn't thread-safe; the threads then each fill a contiguous
+     *   run of them. Inputs too short to give each thread PARALLEL_GRAIN
+     *   characters use fewer threads.
+     *
+     *   Marks keep their offsets as far as the new contents reach, and
+     *   the journal is cleared, as for assignment.
+     *
+     * \param threads  how many threads to use; 0 means one per core
+     *
+     * \warning invalidates all iterators
+     */
+    void assign(const char* chars, size_t n, size_t threads = 0);
+
     // Standard string functions: size, append, equality, less than    
     size_t size() const;    ///< String size \note constant time
     static const size_t CHUNKSIZE = 12;
+
+    /// Number of chunks stored inside the ChunkyString object itself;
+    /// strings of up to INLINE_CHUNKS * CHUNKSIZE characters never allocate.
+    static const size_t INLINE_CHUNKS = 2;
+
+    /**
+     * \struct ChunkStats
+     * \brief How full the chunks of a ChunkyString are, in more detail
+     *        than utilization().
+     *
+     * \details A chunk is under-filled when fewer than half of its cells
+     *          are in use. A run is a maximal sequence of adjacent
+     *          under-filled chunks, which is what local merging in erase
+     *          and the reflow policy are meant to prevent.
+     */
+    struct ChunkStats {
+        size_t chunks_;                  ///< number of chunks
+        size_t lengths_[CHUNKSIZE + 1];  ///< lengths_[n]: chunks holding n
+        size_t underfilled_;             ///< chunks less than half full
+        size_t underfilledRuns_;         ///< runs of under-filled chunks
+        size_t longestUnderfilledRun_;   ///< chunks in the longest run
+    };
+
+    /// Events counted when built with CHUNKYSTRING_INSTRUMENT set to 1;
+    /// the first four are also timed.
+    enum Event { PUSH_BACK, INSERT, ERASE, REFLOW,
+                 SPLIT, MERGE, ALLOCATION, EVENTS };
+
+    /// Latency histogram buckets; bucket b counts events that took
+    /// between 2^b and 2^(b+1) - 1 nanoseconds (bucket 0 also takes 0).
+    static const size_t LATENCY_BUCKETS = 32;
+
+    /**
+     * \struct OpCounters
+     * \brief One thread's event counts and latency histograms.
+     */
+    struct OpCounters {
+        size_t counts_[EVENTS];
+        size_t latencies_[EVENTS][LATENCY_BUCKETS];
+    };
+
+    /**
+     * \class EditBatch
+     * \brief Edits collected to be applied together by apply().
+     *
+     * \details Every offset refers to the string as it was before the
+     *          batch, as in a diff. Edits must be added in order of
+     *          offset and may not overlap; several insertions at one
+     *          offset go in the order they were added.
+     */
+    class EditBatch {
+    public:
+        /// Replace count characters at offset with text
+        void replace(size_t offset, size_t count, const std::string& text);
+
+        /// Insert text before the character at offset
+        void insert(size_t offset, const std::string& text);
+
+        /// Erase count characters starting at offset
+        void erase(size_t offset, size_t count);
+
+        size_t size() const;    ///< number of edits
+        bool empty() const;
+        void clear();
+
+    private:
+        friend class ChunkyString;
+
+        struct Edit {
+            size_t offset_;
+            size_t count_;
+            std::string text_;
+        };
+        std::vector<Edit> edits_;
+    };
     
+    /**
+     * \class Snapshot
+     * \brief An immutable copy of a ChunkyString's contents, for readers
+     *        on other threads.
+     *
+     * \details Copies share one buffer, and nothing ever writes to it,
+     *          so any number of threads may read a snapshot (and copy
+     *          it) without locking while the string goes on changing.
+     *          The buffer is freed along with the last copy.
+     *
+     *          Making one is not cheap: it copies the whole string (see
+     *          ChunkyString::snapshot()). Only copying a Snapshot is.
+     */
+    class Snapshot {
+    public:
+        ///< Default constructor: an empty snapshot
+        Snapshot();
+
+        size_t size() const;
+        bool empty() const;
+
+        /// The characters, contiguous; not NUL-terminated
+        const char* data() const;
+        const char* begin() const;
+        const char* end() const;
+        char operator[](size_t offset) const;
+
+    private:
+        friend class ChunkyString;
+        explicit Snapshot(std::shared_ptr<const std::string> text);
+
+        std::shared_ptr<const std::string> text_;   // nullptr when empty
+    };
+
     ChunkyString& operator+=(const ChunkyString& rhs); ///< String concatenation
 
-    bool operator==(const ChunkyString& rhs) const;    ///< String equality
+    /**
+     * \brief String equality
+     * \details
+     *   Strings of the same size whose hashes are both cached (say, as
+     *   keys of an unordered container) are first compared by those, so
+     *   repeatedly comparing such unchanged, unequal strings is constant
+     *   time. Hashes aren't computed just for this: otherwise it is one
+     *   pass that stops at the first difference.
+     */
+    bool operator==(const ChunkyString& rhs) const;
     bool operator!=(const ChunkyString& rhs) const;    ///< String inequality
 
     /// Lexicographical string comparison
     bool operator<(const ChunkyString& rhs) const; 
 
+    /**
+     * \brief Iterator to the character at offset, or end() if offset is
+     *        size()
+     *
+     * \note linear in the number of chunks before it
+     */
+    iterator iterator_at(size_t offset);
+
+    /// find() result when there is no match
+    static const size_t npos = size_t(-1);
+
+    /**
+     * \brief Offset of the first occurrence of pattern at or after from
+     *
+     * \returns the offset, or npos if there is none; an empty pattern is
+     *          found at from, if from is at most size()
+     *
+     * \note linear in the characters searched (KMP)
+     */
+    size_t find(const std::string& pattern, size_t from = 0) const;
+
+    /**
+     * \brief Number of occurrences of pattern, overlapping ones included
+     *
+     * \details Unlike replace_all(), which replaces "aa" twice in "aaaa",
+     *          this counts it three times: once per offset it starts at.
+     *
+     * \throws std::invalid_argument if pattern is empty
+     */
+    size_t count(const std::string& pattern) const;
+
+    /// Fewest characters worth handing to a thread of their own
+    static const size_t PARALLEL_GRAIN = 64 * 1024;
+
+    /**
+     * \brief String equality, with the comparison split across threads
+     * \details
+     *   One pass over the chunk lengths of both strings finds where to
+     *   cut them into equal ranges; each range is then compared on a
+     *   `std::thread` of its own, and the first mismatch found stops the
+     *   rest. Strings too short to give each thread PARALLEL_GRAIN
+     *   characters use fewer threads; too short for two, this is just
+     *   operator==.
+     *
+     *   Otherwise hashes are only used if both are already cached;
+     *   computing them would be a serial pass of its own.
+     *
+     * \param threads  how many threads to use; 0 means one per core
+     *
+     * \note linear time divided by the threads, plus a serial pass over
+     *       the chunk lengths
+     *
+     * \warning neither string may be modified while this runs
+     */
+    bool parallel_equal(const ChunkyString& rhs, size_t threads = 0) const;
+
+    /**
+     * \brief Three-way lexicographical comparison, split across threads
+     *        like parallel_equal()
+     *
+     * \details Ranges after one known to hold a mismatch stop early; the
+     *          ranges before it must still finish.
+     *
+     * \returns a negative number, zero, or a positive number as this
+     *          string is less than, equal to, or greater than rhs, in the
+     *          order operator< uses
+     */
+    int parallel_compare(const ChunkyString& rhs, size_t threads = 0) const;
+
+    /**
+     * \brief find(), split across threads
+     *
+     * \details The offsets a match may start at are cut into one range
+     *          per thread, like parallel_equal(); each thread reads
+     *          pattern.size() - 1 characters past the end of its range to
+     *          see matches that straddle the cut. Ranges after one known
+     *          to hold a match stop early.
+     */
+    size_t parallel_find(const std::string& pattern, size_t from = 0,
+                         size_t threads = 0) const;
+
+    /// count(), split across threads like parallel_find(); the ranges'
+    /// counts are summed
+    size_t parallel_count(const std::string& pattern, 
+                          size_t threads = 0) const;
+
+    /**
+     * \brief Hash of the string's contents
+     * \details
+     *   Streams over each chunk's characters a 64-bit word at a time
+     *   (an xxHash64-style round), so equal strings hash equally no matter
+     *   how their characters are divided into chunks. Never allocates.
+     *
+     *   The result is cached until the string is next modified (by
+     *   push_back, insert, erase or a write through an iterator), so
+     *   rehashing an unchanged string is constant time. Several threads
+     *   may call it at once on a string none of them modifies.
+     */
+    size_t hash() const;
+
+    /**
+     * \brief A copy of the string's current contents, as a Snapshot
+     * \details
+     *   This is a full copy, not a view that shares chunks with the
+     *   string: chunks are edited in place and come from a pool inside
+     *   the string, so they can't outlive it or stay frozen. The first
+     *   snapshot after any modification therefore copies every
+     *   character, on the calling thread; an editor that takes one per
+     *   keystroke pays for a copy of the whole string per keystroke.
+     *
+     *   What is saved is repeated copies of an unchanged string: the copy
+     *   is cached (like hash()) until the string is next modified, so
+     *   every snapshot of it shares one buffer. Modifications drop the
+     *   cached copy as they happen, so an unchanged string is recognized
+     *   without rereading it, and the cache doesn't keep the buffer alive
+     *   once the snapshots are gone.
+     *
+     * \note linear time after a modification, constant time otherwise
+     *
+     * \warning not synchronized: it fills the cache inside the string, so
+     *          it must not run at the same time as any other call on the
+     *          string, another snapshot() included. Call it from the
+     *          thread that modifies the string, or under the lock its
+     *          writers take, and hand the Snapshot to the readers.
+     */
+    Snapshot snapshot();
+
     /**
      * \brief Insert a character before the character at i.
      * \details
@@ -126,6 +455,120 @@ public:
      */
     iterator erase(iterator i);
 
+    /**
+     * \brief Replace the characters in [first, last) with the n
+     *        characters at s
+     * \details
+     *   As many characters as both sides have are overwritten in place.
+     *   The rest are erased or inserted a chunk at a time, so only the
+     *   chunks at the two ends of the edit are split or merged.
+     *
+     * \returns an iterator to the character after the replacement
+     *
+     * \note linear in the length of [first, last) plus n
+     *
+     * \warning invalidates all iterators except the returned iterator
+     */
+    iterator replace(iterator first, iterator last, const char* s, size_t n);
+
+    /**
+     * \brief Replace every occurrence of pattern with replacement
+     * \details
+     *   Occurrences are found left to right and don't overlap. A first
+     *   pass looks for one; if nothing matches, the string is left as is
+     *   and nothing is allocated. Otherwise the chunks before the first
+     *   match are kept as they are, and the rest of the result is built
+     *   in one pass into full chunks, which take the place of the old
+     *   ones.
+     *
+     * \returns the number of occurrences replaced
+     *
+     * \throws std::invalid_argument if pattern is empty
+     *
+     * \note linear in the string size plus the output size
+     *
+     * \warning invalidates all iterators
+     */
+    size_t replace_all(const std::string& pattern,
+                       const std::string& replacement);
+
+    /**
+     * \brief Apply every edit in batch
+     * \details
+     *   One left-to-right pass over the chunks: chunks no edit touches
+     *   are moved over whole, and only the chunks around each edit are
+     *   rebuilt.
+     *
+     * \throws std::invalid_argument if the edits are out of order,
+     *         overlap, or reach past the end; the string is unchanged
+     *
+     * \note linear in the number of chunks plus the edited characters
+     *
+     * \warning invalidates all iterators
+     */
+    void apply(const EditBatch& batch);
+
+    /**
+     * \brief Start recording edits so they can be undone
+     * \details
+     *   The journal keeps, for each edit, the characters it removed and
+     *   the ones it added, so its size follows the edited bytes, not the
+     *   string. Consecutive one-character inserts and erases (typing,
+     *   backspace, delete) coalesce into one run that is undone as a
+     *   whole; apply() and replace_all() are undone as a whole too.
+     *
+     *   push_back, insert, erase, replace, replace_all and apply are
+     *   recorded. Writes in place (through iterators, transform_inplace,
+     *   translate or for_each_char) don't change any offsets, so they
+     *   don't upset the journal, but they aren't recorded either.
+     *   Assigning to the string forgets everything recorded.
+     *
+     * \note while journaling, insert and erase also walk the chunks to
+     *       find their offset
+     */
+    void enable_journal();
+
+    /// Stop recording edits and forget the recorded ones
+    void disable_journal();
+
+    /// True between enable_journal() and disable_journal()
+    bool journaling() const;
+
+    /**
+     * \brief Undo the most recent recorded edit (or run of edits)
+     *
+     * \returns false if there was nothing to undo
+     *
+     * \warning invalidates all iterators; marks follow the edit
+     */
+    bool undo();
+
+    /// Redo the most recently undone edit; false if there is none. Any
+    /// new edit forgets what could be redone.
+    bool redo();
+
+    bool can_undo() const;
+    bool can_redo() const;
+
+    /// Make the next edit start a new undo step instead of coalescing
+    /// with the last one, e.g., at a word boundary or after a pause
+    void end_undo_step();
+
+    /// Bytes held by the journal's recorded text
+    size_t journal_bytes() const;
+
+    /**
+     * \brief Change when and how much insert and erase repack the string
+     *
+     * \details The default policy repacks 2 chunks per edit while
+     *          utilization is below 1/2. A target_ of 0 turns repacking
+     *          off, leaving only the local merging erase always does.
+     */
+    void set_reflow_policy(const ReflowPolicy& policy);
+
+    /// The current reflow policy
+    const ReflowPolicy& reflow_policy() const;
+
     /**
      * \brief Average capacity of each chunk, as a percentage
      * \details 
@@ -144,6 +587,221 @@ public:
      */
     double utilization() const;
 
+    /**
+     * \brief Histogram of chunk lengths and under-filled runs
+     *
+     * \note linear in the number of chunks (one pass)
+     */
+    ChunkStats stats() const;
+
+    /**
+     * \brief Breakdown of the memory this string uses
+     *
+     * \note constant time, plus a pass over the marks and the journal if
+     *       there are any
+     */
+    MemoryUsage memory_usage() const;
+
+    /**
+     * \brief Sum of memory_usage() over every live ChunkyString
+     *
+     * \details Every ChunkyString registers itself on construction, so
+     *          this covers all of them, in every thread. Registering only
+     *          takes a lock shared with strings made on the same thread;
+     *          this takes each of those locks in turn.
+     *
+     *          Registering and unregistering cost every string an
+     *          uncontended lock and unlock, a few nanoseconds, and 24
+     *          bytes for the links (see Design.md).
+     *
+     * \warning Reads every string; no other thread may be modifying a
+     *          ChunkyString while this runs.
+     *
+     * \note linear in the number of live strings
+     */
+    static MemoryUsage total_memory_usage();
+
+    /// True if this build records OpCounters
+    static bool instrumented();
+
+    /**
+     * \brief Events recorded by the calling thread since the last
+     *        reset_op_counters()
+     *
+     * \details Without CHUNKYSTRING_INSTRUMENT nothing is recorded and
+     *          every count is zero. Allocations are new heap allocations
+     *          made by a push_back, insert or erase.
+     */
+    static const OpCounters& op_counters();
+
+    /// Zero the calling thread's counters
+    static void reset_op_counters();
+
+    /// Print the calling thread's counters as text, or as JSON if json
+    static void dump_op_counters(std::ostream& out, bool json = false);
+
+    /// Name of an event, as used by dump_op_counters()
+    static const char* event_name(Event event);
+
+    /**
+     * \brief Number of characters the string can hold before push_back
+     *        needs to allocate
+     * \details
+     *   Counts the free cells of the last chunk plus CHUNKSIZE for every
+     *   chunk that can be added without allocating (unused inline chunks
+     *   and chunks set aside by reserve()).
+     */
+    size_t capacity() const;
+
+    /**
+     * \brief Set aside room for a string of n characters
+     * \details
+     *   If capacity() is less than n, allocates the missing
+     *   `ceil((n - capacity()) / CHUNKSIZE)` chunks as a single block, so
+     *   building a string of known size allocates once.
+     *
+     *   Until shrink_to_fit(), the string keeps at least the chunks it
+     *   then has, in use or not: chunks freed by edits are set aside for
+     *   reuse while there are fewer. Without a reservation, edits give
+     *   chunks they free back to the heap.
+     *
+     * \param n     number of characters to make room for
+     */
+    void reserve(size_t n);
+
+    /**
+     * \brief Repack the string into full chunks and free unused ones
+     * \details
+     *   Runs compact(), then frees every chunk the string no longer uses
+     *   (except for blocks from reserve() that are still partly in use).
+     *
+     * \warning invalidates all iterators
+     */
+    void shrink_to_fit();
+
+    /**
+     * \brief Repack the string so every chunk but the last is full
+     * \details
+     *   A single pass over the chunks that copies runs of characters onto
+     *   the free tail of the chunk before them and frees the chunks left
+     *   empty. Afterwards utilization() is as high as it can be.
+     *
+     * \warning invalidates all iterators
+     */
+    void compact();
+
+    /**
+     * \brief Do a bounded amount of compaction
+     * \details
+     *   Continues the compaction pass where the previous call left off,
+     *   filling at most budget chunks, so the work can be spread over
+     *   idle time. Edits that remove chunks restart the pass.
+     *
+     * \param budget    maximum number of chunks to fill
+     *
+     * \returns true if the pass reached the end of the string, after
+     *   which the next call starts a new pass.
+     *
+     * \warning invalidates all iterators
+     */
+    bool compact_step(size_t budget);
+
+    /**
+     * \brief Number of UTF-8 code points in the string
+     * \details
+     *   Counts the bytes that start a code point (i.e., everything but
+     *   continuation bytes), so a sequence split across chunks is only
+     *   counted once.
+     *
+     * \note linear in the number of chunks; every write keeps each
+     *       chunk's count current
+     */
+    size_t codepoints() const;
+
+    /**
+     * \brief Find the first byte of the n-th UTF-8 code point
+     * \details
+     *   Whole chunks are skipped using their code-point counts, so
+     *   only the chunk containing the code point is scanned byte by byte.
+     *
+     * \param n     zero-based code-point index
+     *
+     * \returns an iterator to the code point's lead byte, or end() if the
+     *   string has n or fewer code points.
+     */
+    iterator codepoint_at(size_t n);
+    const_iterator codepoint_at(size_t n) const;  ///< \copydoc codepoint_at
+
+    /**
+     * \brief Checks whether the string is well-formed UTF-8
+     * \details
+     *   Rejects overlong encodings, surrogates, code points past U+10FFFF
+     *   and truncated sequences, including ones cut off at the end of the
+     *   string. Sequences may straddle chunk boundaries.
+     */
+    bool valid_utf8() const;
+
+    /**
+     * \brief Calls f(chars, length) on each chunk's characters, in order
+     * \details
+     *   Each call gets a plain array, so f's own loop has no chunk
+     *   boundaries in it and can be unrolled or vectorized. Through a
+     *   non-const string, f gets `char*` and may change the characters
+     *   (but not their number); the cached hash and code-point counts
+     *   are then discarded.
+     *
+     * \returns f, like `std::for_each`
+     */
+    template <typename F>
+    F for_each_chunk(F f) const;
+    template <typename F>
+    F for_each_chunk(F f);    ///< \copydoc for_each_chunk
+
+    /**
+     * \brief Calls f on every character, in order
+     * \details
+     *   The same as for_each_chunk() with an inner loop over each chunk.
+     *   Through a non-const string, f gets `char&` and the caches are
+     *   discarded, so read-only passes should go through a const
+     *   reference.
+     *
+     * \returns f, like `std::for_each`
+     */
+    template <typename F>
+    F for_each_char(F f) const;
+    template <typename F>
+    F for_each_char(F f);     ///< \copydoc for_each_char
+
+    /**
+     * \brief Replaces every character c with f(c)
+     * \details
+     *   Only rewrites characters within their chunks; the chunk list and
+     *   all iterators are left alone.
+     */
+    template <typename F>
+    void transform_inplace(F f);
+
+    /**
+     * \brief Replaces every character c with
+     *        `table[static_cast<unsigned char>(c)]`
+     */
+    void translate(const char (&table)[256]);
+
+    /**
+     * \brief Translates like tr(1): each character of from becomes the
+     *        character at the same place in to
+     * \details
+     *   If to is shorter than from, its last character is used for the
+     *   rest of from. If a character appears in from more than once, the
+     *   last occurrence wins.
+     *
+     * \param from  characters to replace
+     * \param to    replacements
+     *
+     * \throws std::invalid_argument if to is empty
+     */
+    void translate(const std::string& from, const std::string& to);
+
 private:
     /***
      * \struct Chunk
@@ -157,12 +815,294 @@ private:
        size_t length_;
        char chars_[CHUNKSIZE];
 
+       // Number of code-point lead bytes in chars_. Every write keeps it
+       // current, so reading it is all codepoints() has to do.
+       uint8_t codepoints_;
+
        Chunk(size_t length_, size_t CHUNKSIZE);
     };
+    static_assert(CHUNKSIZE <= UINT8_MAX, 
+                  "Chunk::codepoints_ must be able to count every character");
+
+    // List nodes hold two links plus a Chunk.
+    using ChunkPoolType = ChunkPool<2 * sizeof(void*) + sizeof(Chunk), 
+                                    INLINE_CHUNKS>;
+    using ChunkList = std::list<Chunk, ChunkAllocator<Chunk, ChunkPoolType>>;
+
+    /**
+     * \brief Fill chunk dst with characters taken from the chunks after it
+     *
+     * \details Stops when dst is full or no characters follow; chunks
+     *          left empty are freed.
+     *
+     * \param dst   chunk to fill
+     * \param keep  if not null, an iterator that is kept pointing at the
+     *              same character as characters move
+     *
+     * \returns the chunk after dst, i.e., the next one to fill
+     */
+    ChunkList::iterator fillChunk(ChunkList::iterator dst, iterator* keep);
+
+    /// compact_step(budget), keeping keep (if not null) valid
+    bool stepCompaction(size_t budget, iterator* keep);
+
+    /// Repack a little if the reflow policy asks for it; keeps keep valid
+    void reflow(iterator& keep);
+
+    /// Free chunk c, which must be empty; returns the chunk after it
+    ChunkList::iterator eraseChunk(ChunkList::iterator c);
+
+    /**
+     * \brief Split a full chunk, moving its back half into a new chunk
+     *        inserted after it
+     */
+    void splitChunk(ChunkList::iterator c);
+
+    /// push_back(c) without the instrumentation, for edits that append
+    void appendChar(char c);
+
+    /// Append n characters to list, filling its last chunk first
+    static void appendChars(ChunkList& list, const char* chars, size_t n);
+
+    /**
+     * \brief Erase count characters starting at index i of chunk c
+     *
+     * \returns the character after the erased ones, after merging the
+     *          chunks on either side of the cut if they fit in one
+     */
+    iterator eraseSpan(ChunkList::iterator c, size_t i, size_t count);
+
+    /**
+     * \brief Insert the n characters at s before index i of chunk c
+     *
+     * \details Fills the free space around the insertion point first,
+     *          then adds full chunks.
+     *
+     * \returns the character after the inserted ones
+     */
+    iterator insertSpan(ChunkList::iterator c, size_t i, 
+                        const char* s, size_t n);
+
+    /// Count the code points starting in chunk afresh, after a write
+    /// that may have changed any of its characters
+    static void recount(Chunk& chunk);
+
+    /// A character (or end()) as a chunk and an index in it
+    struct Position {
+        ChunkList::const_iterator chunk_;
+        size_t index_;
+    };
+
+    /// The positions of the given offsets, which must be sorted, found in
+    /// one pass over the chunks
+    std::vector<Position> positionsAt(const std::vector<size_t>& offsets) 
+        const;
+
+    /**
+     * \brief Where the n characters from a and from b first differ
+     *
+     * \details a and b are left on the first difference, if there is
+     *          one. Gives up early, returning n, once earliest (the first
+     *          part known to differ) drops below limit.
+     *
+     * \returns the offset of the first difference, or n if none
+     */
+    static size_t mismatch(Position& a, Position& b, size_t n,
+                           const std::atomic<size_t>& earliest, 
+                           size_t limit);
+
+    /**
+     * \brief Report each match of pattern starting in the n characters
+     *        from p to found(offset from p), until found returns false
+     *
+     * \details fail is pattern's KMP table. Gives up early like
+     *          mismatch().
+     */
+    template <typename F>
+    void matchesFrom(Position p, size_t n, const std::string& pattern,
+                     const std::vector<size_t>& fail,
+                     const std::atomic<size_t>& earliest, size_t limit,
+                     F found) const;
+
+    /// How many threads to split work on size characters across, given
+    /// the number asked for (0 for one per core)
+    static size_t threadsFor(size_t size, size_t threads);
 
-    std::list<Chunk> chunks_; 
+    /// Returns the index in chunk of the lead byte of its n-th code point.
+    static size_t leadIndex(const Chunk& chunk, size_t n);
+
+    // The first INLINE_CHUNKS list nodes come from here rather than the
+    // heap. Declared before chunks_ so it outlives the list's nodes.
+    ChunkPoolType pool_;
+    ChunkList chunks_; 
     size_t size_; // Current size of ChunkyString
 
+    // Marks, the journal, the cached snapshot, compaction progress and
+    // the reflow policy; allocated the first time any of them is needed,
+    // so strings that use none stay small. nullptr until then.
+    struct Extras;
+    std::unique_ptr<Extras> extras_;
+
+    /// extras_, allocated if need be
+    Extras& extras();
+
+    /// Add the memory extras_ holds on to, which must exist, to usage
+    void extrasUsage(MemoryUsage& usage) const;
+
+    /// Make the next compaction step start a new pass
+    void restartCompaction();
+
+    // The live strings that total_memory_usage() walks, split into
+    // shards with a lock each. Threads take shards in turn, so strings
+    // made on different threads rarely share a lock.
+    struct LiveShard;
+    static const size_t LIVE_SHARDS = 64;
+    static LiveShard liveShards_[LIVE_SHARDS];
+
+    // This string's shard, and its links in the shard's list
+    LiveShard* liveShard_;
+    ChunkyString* prevLive_;
+    ChunkyString* nextLive_;
+
+    /// The shard strings made on the calling thread go into
+    static LiveShard& threadShard();
+
+    /// Add this string to / remove it from the list of live strings
+    void registerLive();
+    void unregisterLive();
+
+    // Cached result of hash(), or UNHASHED; every modification resets
+    // it. Const readers on several threads may fill it at once, so it is
+    // atomic; they all store the same value.
+    mutable std::atomic<size_t> hash_;
+    static const size_t UNHASHED = 0;
+
+    /// True if both strings' hashes are cached and differ
+    bool hashesDiffer(const ChunkyString& rhs) const;
+
+    /// Forget the cached hash and snapshot; every modification calls
+    /// this
+    void changed();
+
+    // Edits recorded for undo() and redo()
+    struct Journal;
+
+    /// The journal while journaling, nullptr otherwise
+    Journal* journal() const;
+
+    /// Record the insertion of c at offset, extending the current run if
+    /// it continues it
+    void recordInsert(size_t offset, char c);
+
+    /// Record the erasure of c at offset, extending the current run if
+    /// it continues it
+    void recordErase(size_t offset, char c);
+
+    /// Record the replacement of erased at offset with inserted; a
+    /// chained edit is undone along with the one recorded before it
+    void recordReplace(size_t offset, std::string erased,
+                       std::string inserted, bool chained);
+
+    /// Offset of the character at i; linear in the chunks before it
+    size_t offsetOf(const_iterator i) const;
+
+    /// True if any marks are on the string
+    bool hasMarks() const;
+
+    /// Where an edit replaced count characters at offset with length
+    /// new ones
+    struct Span {
+        size_t offset_;
+        size_t count_;
+        size_t length_;
+    };
+
+    /// A mark and its offset, for edits that rebuild the chunk list
+    using MarkOffset = std::pair<size_t, Mark*>;
+
+    /// Key of chunk c in Extras::marksIn_
+    const Chunk* markKey(ChunkList::const_iterator c) const;
+
+    /// Put mark at index i of chunk c (or at end())
+    void placeMark(Mark* mark, ChunkList::iterator c, size_t i);
+
+    /// Remove mark from Extras::marksIn_
+    void unplaceMark(Mark* mark);
+
+    /**
+     * \brief Move the marks at indices [lo, hi) of chunk from to chunk
+     *        to, adding delta to their indices
+     *
+     * \details Called by every edit that moves characters, so marks keep
+     *          pointing at the same characters; only marks in the chunks
+     *          involved are looked at.
+     */
+    void shiftMarks(ChunkList::iterator from, size_t lo, size_t hi,
+                    ChunkList::iterator to, ptrdiff_t delta);
+
+    /// Move the marks at indices [lo, hi) of chunk from to index i of
+    /// chunk to, e.g., when the characters they were on are erased
+    void collapseMarks(ChunkList::iterator from, size_t lo, size_t hi,
+                       ChunkList::iterator to, size_t i);
+
+    /// Take every mark off the chunks, returning them sorted by offset
+    std::vector<MarkOffset> liftMarks();
+
+    /// Put lifted marks back, at their (possibly changed) offsets
+    void dropMarks(std::vector<MarkOffset>& marks);
+
+    /// Change the offsets of lifted marks to account for edits, which
+    /// are sorted and don't overlap
+    static void remapMarks(std::vector<MarkOffset>& marks,
+                           const std::vector<Span>& edits);
+
+    /**
+     * \class CharReference
+     * \brief What a non-const iterator dereferences to: a character
+     *        that tells its string when it is written
+     *
+     * \details Reading converts to the character. Assigning stores it and
+     *          updates the chunk's code-point count and the string's hash
+     *          at that moment, so a write through a reference that was
+     *          held for a while is seen by the caches all the same.
+     *
+     *          Like `std::vector<bool>::reference`, it is a proxy, not a
+     *          `char&`: `char& c = *i` doesn't compile, `char c = *i`
+     *          reads. swap() exchanges the characters two references
+     *          refer to, so algorithms that swap through iterators
+     *          (std::reverse, std::iter_swap, std::swap_ranges) work.
+     */
+    class CharReference {
+    public:
+        CharReference(const CharReference& other) = default;
+
+        operator char() const;
+
+        /// Store c in the character, keeping the caches current
+        CharReference& operator=(char c);
+
+        /// Store the character other refers to
+        CharReference& operator=(const CharReference& other);
+
+        /// Exchange the characters a and b refer to; defined here so
+        /// argument-dependent lookup finds it, as std::iter_swap expects
+        friend void swap(CharReference a, CharReference b)
+        {
+            char c = a;
+            a = char(b);
+            b = c;
+        }
+
+    private:
+        template <bool const_iter>
+        friend class Iterator;
+        CharReference(char* c, Chunk* chunk, ChunkyString* owner);
+
+        char* char_;
+        Chunk* chunk_;           // chunk holding char_
+        ChunkyString* owner_;    // string holding chunk_
+    };
+
     /**
      * \class Iterator
      * \brief STL-style iterator for ChunkyString.
@@ -177,6 +1117,14 @@ private:
      *          is provided and meaningful for all iterators except
      *          ChunkyString::begin.
      *
+     *          A non-const iterator dereferences to a CharReference, so
+     *          writes through it keep the string's caches current; its
+     *          reference type is that proxy rather than `char&`.
+     *
+     *          Iteration never allocates. push_back leaves iterators
+     *          valid; insert and erase invalidate all but the one they
+     *          return.
+     *
      *  \remarks The design of the templated iterator was inspired by these
      *           two sources:
      *  www.drdobbs.com/the-standard-librarian-defining-iterato/184401331
@@ -196,13 +1144,16 @@ private:
         using value_type = char;
         using reference = typename std::conditional<const_iter, 
                                                     const value_type&, 
-                                                    value_type&>::type;
+                                                    CharReference>::type;
         using pointer = typename std::conditional<const_iter, 
                                                   const value_type*, 
                                                   value_type*>::type;
         using list_iterator_type = typename std::conditional<const_iter, 
-                                    std::list<Chunk>::const_iterator, 
-                                    std::list<Chunk>::iterator>::type;
+                                    ChunkList::const_iterator, 
+                                    ChunkList::iterator>::type;
+        using owner_type = typename std::conditional<const_iter, 
+                                                     const ChunkyString*, 
+                                                     ChunkyString*>::type;
         using difference_type   = ptrdiff_t;
         using iterator_category = std::bidirectional_iterator_tag;
         using const_reference   = const value_type&;
@@ -217,9 +1168,117 @@ private:
     private:
         friend class ChunkyString;
         friend struct Chunk;
-        Iterator(list_iterator_type chunk_, size_t charInd_);
+        Iterator(list_iterator_type chunk, size_t charIndex,
+                 owner_type owner);
+
+        /// Point at the first character of chunk_, or at end()
+        void enterChunk();
+
+        /// Position of the character within its chunk; not for end()
+        size_t index() const;
+
+        // cur_ and chunkEnd_ make ++ a pointer bump and compare; the list
+        // is only consulted when cur_ reaches chunkEnd_. Both are nullptr
+        // at end().
         list_iterator_type chunk_;
-        size_t charInd_;
+        pointer cur_;         // the character
+        pointer chunkEnd_;    // one past chunk_'s last character
+        owner_type owner_;    // string to notify of writes through *this
+    };
+
+public:
+    /**
+     * \class Mark
+     * \brief A position in a ChunkyString that follows its character
+     *        through edits.
+     *
+     * \details Unlike an iterator, a mark stays valid across insert,
+     *          erase, replace and every other edit. It keeps pointing at
+     *          the same character; if that character is erased, it moves
+     *          to the character after it. A mark at end() stays at end().
+     *
+     *          Keeping marks current costs each edit time proportional
+     *          to the marks in the chunks it touches. Edits that rebuild
+     *          the whole chunk list (apply(), replace_all(), assignment)
+     *          move every mark in one pass.
+     *
+     *          A mark is detached when its string is destroyed; copies
+     *          of a mark are separate marks at the same place.
+     */
+    class Mark {
+    public:
+        ///< Default constructor: a detached mark
+        Mark();
+
+        /// A mark on the character at position of text
+        Mark(ChunkyString& text, const_iterator position);
+
+        Mark(const Mark& other);
+        Mark& operator=(const Mark& other);
+        ~Mark();
+
+        /// False for default-constructed marks and marks whose string
+        /// has been destroyed
+        bool attached() const;
+
+        /// Where the mark is now; the mark must be attached
+        iterator position() const;
+
+        /**
+         * \brief Where the mark is now, as an offset from the start
+         *
+         * \note linear in the number of chunks before the mark
+         */
+        size_t offset() const;
+
+        /// Move the mark to position of its string; the mark must be
+        /// attached
+        void move_to(const_iterator position);
+
+    private:
+        friend class ChunkyString;
+
+        ChunkyString* owner_;
+        ChunkList::iterator chunk_;
+        size_t index_;
+    };
+
+private:
+    /**
+     * \class CodepointIterator
+     * \brief Read-only iterator over the UTF-8 code points of a
+     *        ChunkyString.
+     *
+     * \details Dereferencing decodes the code point starting at the
+     *          current lead byte, reading across chunk boundaries as
+     *          needed. Malformed sequences decode to U+FFFD, and stray
+     *          continuation bytes are grouped with the code point before
+     *          them, so iteration visits exactly codepoints() positions.
+     */
+    class CodepointIterator {
+    public:
+        ///< Default constructor
+        CodepointIterator();
+
+        using value_type        = char32_t;
+        using reference         = char32_t;
+        using pointer           = void;
+        using difference_type   = ptrdiff_t;
+        using iterator_category = std::input_iterator_tag;
+
+        CodepointIterator& operator++();
+        char32_t operator*() const;
+        bool operator==(const CodepointIterator& rhs) const;
+        bool operator!=(const CodepointIterator& rhs) const;
+
+        /// The byte position of the current code point's lead byte
+        const_iterator base() const;
+
+    private:
+        friend class ChunkyString;
+        CodepointIterator(const_iterator pos, const_iterator end);
+        const_iterator pos_;
+        const_iterator end_;
     };
 };
 
@@ -233,6 +1292,29 @@ private:
  */
 std::ostream& operator<<(std::ostream& out, const ChunkyString& text);
 
+/**
+ * \brief Print operator: displays chunk statistics on the given stream
+ *
+ * \param out   the display stream
+ * \param stats statistics from ChunkyString::stats()
+ *
+ * \returns the display stream
+ */
+std::ostream& operator<<(std::ostream& out, 
+                         const ChunkyString::ChunkStats& stats);
+
+namespace std {
+    /// Lets ChunkyString be used as a key in unordered containers.
+    template <>
+    struct hash<ChunkyString> {
+        size_t operator()(const ChunkyString& text) const
+        {
+            return text.hash();
+        }
+    };
+}
+
 #include "iterator-private.hpp"
+#include "traversal-private.hpp"
 
 #endif // CHUNKYSTRING_HPP_INCLUDED
@@ -0,0 +1,586 @@
+/*
+ * \file concurrentchunkystring.cpp
+ * \authors Ricky Pan, Iris Liu
+ * \brief Implementation of SharedMutex, ConcurrentChunkyString and
+ *        AppendOnlyChunkyString
+ */
+
+#include "concurrentchunkystring.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+// ---------------------------------------------
+// Implementation of SharedMutex
+// ---------------------------------------------
+//
+SharedMutex::SharedMutex()
+    : readers_{0}, waitingWriters_{0}, writing_{false}
+{
+    // Nothing to do here!
+}
+
+void SharedMutex::lock()
+{
+    std::unique_lock<std::mutex> guard(mutex_);
+    ++waitingWriters_;
+    writerMayGo_.wait(guard, [this] { return !writing_ && readers_ == 0; });
+    --waitingWriters_;
+    writing_ = true;
+}
+
+void SharedMutex::unlock()
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    writing_ = false;
+
+    // readers check for waiting writers themselves
+    writerMayGo_.notify_one();
+    readersMayGo_.notify_all();
+}
+
+void SharedMutex::lock_shared()
+{
+    std::unique_lock<std::mutex> guard(mutex_);
+    readersMayGo_.wait(guard, [this] {
+        return !writing_ && waitingWriters_ == 0;
+    });
+    ++readers_;
+}
+
+void SharedMutex::unlock_shared()
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+    --readers_;
+    if (readers_ == 0 && waitingWriters_ != 0)
+    {
+        writerMayGo_.notify_one();
+    }
+}
+
+/// Holds a SharedMutex shared for as long as it lives
+class SharedLock {
+public:
+    explicit SharedLock(SharedMutex& mutex)
+        : mutex_(mutex)
+    {
+        mutex_.lock_shared();
+    }
+
+    ~SharedLock()
+    {
+        mutex_.unlock_shared();
+    }
+
+    SharedLock(const SharedLock&) = delete;
+    SharedLock& operator=(const SharedLock&) = delete;
+
+private:
+    SharedMutex& mutex_;
+};
+
+// ---------------------------------------------
+// Implementation of ConcurrentChunkyString
+// ---------------------------------------------
+//
+
+const size_t ConcurrentChunkyString::SEGMENT_SIZE;
+
+/// The segment locks one operation holds, released together
+class ConcurrentChunkyString::Locks {
+public:
+    Locks() = default;
+    Locks(const Locks&) = delete;
+    Locks& operator=(const Locks&) = delete;
+
+    ~Locks()
+    {
+        for (auto i = held_.rbegin(); i != held_.rend(); ++i)
+        {
+            if (i->second)
+            {
+                i->first->lock_.unlock();
+            }
+            else
+            {
+                i->first->lock_.unlock_shared();
+            }
+        }
+    }
+
+    void shared(const Segment& segment)
+    {
+        segment.lock_.lock_shared();
+        held_.push_back(std::make_pair(&segment, false));
+    }
+
+    void exclusive(const Segment& segment)
+    {
+        segment.lock_.lock();
+        held_.push_back(std::make_pair(&segment, true));
+    }
+
+private:
+    // each segment and whether it's held exclusively, in locking order
+    std::vector<std::pair<const Segment*, bool>> held_;
+};
+
+ConcurrentChunkyString::ConcurrentChunkyString()
+    : sizes_(1, 0)
+{
+    segments_.push_back(std::unique_ptr<Segment>(new Segment()));
+}
+
+void ConcurrentChunkyString::lockFor(size_t offset, size_t count,
+                                     size_t inserted, Locks& locks,
+                                     size_t& first, size_t& local)
+{
+    std::lock_guard<std::mutex> index(index_);
+
+    // an insert may go at the end of a segment; an erase starts at a
+    // character
+    size_t j = 0;
+    size_t start = 0;   // offset of segment j
+    while (count == 0 ? offset > start + sizes_[j] 
+                      : offset >= start + sizes_[j])
+    {
+        start += sizes_[j];
+        if (++j == sizes_.size())
+        {
+            throw std::out_of_range("ConcurrentChunkyString: offset "
+                                    "past the end");
+        }
+    }
+    first = j;
+    local = offset - start;
+
+    // check that an erase fits before locking anything
+    size_t after = start;
+    for (size_t k = j; k < sizes_.size(); ++k)
+    {
+        after += sizes_[k];
+    }
+    if (count > after - offset)
+    {
+        throw std::out_of_range("ConcurrentChunkyString: erase past the "
+                                "end");
+    }
+
+    // the edit takes effect in sizes_ now, so edits that look up their
+    // offsets after this one see it, even before it's carried out
+    locks.exclusive(*segments_[j]);
+    sizes_[j] += inserted;
+    size_t take = std::min(sizes_[j] - local, count);
+    sizes_[j] -= take;
+    for (size_t k = j + 1; count > take; ++k)
+    {
+        count -= take;
+        locks.exclusive(*segments_[k]);
+        take = std::min(sizes_[k], count);
+        sizes_[k] -= take;
+    }
+}
+
+void ConcurrentChunkyString::insert(size_t offset, const std::string& text)
+{
+    bool reshape = false;
+    {
+        SharedLock structure(structure_);
+        Locks locks;
+        size_t j;
+        size_t local;
+        lockFor(offset, 0, text.size(), locks, j, local);
+
+        ChunkyString& segment = segments_[j]->text_;
+        ChunkyString::iterator at = segment.iterator_at(local);
+        segment.replace(at, at, text.data(), text.size());
+        reshape = outOfShape(segment.size());
+    }
+    if (reshape)
+    {
+        rebalance();
+    }
+}
+
+void ConcurrentChunkyString::erase(size_t offset, size_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    bool reshape = false;
+    {
+        SharedLock structure(structure_);
+        Locks locks;
+        size_t j;
+        size_t local;
+        lockFor(offset, count, 0, locks, j, local);
+
+        for (; count > 0; ++j, local = 0)
+        {
+            ChunkyString& segment = segments_[j]->text_;
+            size_t take = std::min(segment.size() - local, count);
+            ChunkyString::iterator first = segment.iterator_at(local);
+            ChunkyString::iterator last = segment.iterator_at(local + take);
+            segment.replace(first, last, "", 0);
+            count -= take;
+            reshape = reshape || outOfShape(segment.size());
+        }
+    }
+    if (reshape)
+    {
+        rebalance();
+    }
+}
+
+void ConcurrentChunkyString::push_back(char c)
+{
+    *this += std::string(1, c);
+}
+
+ConcurrentChunkyString&
+    ConcurrentChunkyString::operator+=(const std::string& text)
+{
+    bool reshape = false;
+    {
+        // appending needs no offset, so only the last segment is locked
+        SharedLock structure(structure_);
+        Segment& last = *segments_.back();
+        Locks locks;
+        {
+            std::lock_guard<std::mutex> index(index_);
+            locks.exclusive(last);
+            sizes_.back() += text.size();
+        }
+        ChunkyString::iterator end = last.text_.end();
+        last.text_.replace(end, end, text.data(), text.size());
+        reshape = outOfShape(last.text_.size());
+    }
+    if (reshape)
+    {
+        rebalance();
+    }
+    return *this;
+}
+
+size_t ConcurrentChunkyString::size() const
+{
+    // edits that have looked up their offsets count as done
+    SharedLock structure(structure_);
+    std::lock_guard<std::mutex> index(index_);
+    size_t size = 0;
+    for (size_t segmentSize : sizes_)
+    {
+        size += segmentSize;
+    }
+    return size;
+}
+
+std::string ConcurrentChunkyString::str() const
+{
+    // every segment stays locked until the copy is done; holding index_
+    // while locking them waits out the edits already under way and keeps
+    // new ones from starting in between
+    SharedLock structure(structure_);
+    Locks locks;
+    {
+        std::lock_guard<std::mutex> index(index_);
+        for (const std::unique_ptr<Segment>& segment : segments_)
+        {
+            locks.shared(*segment);
+        }
+    }
+
+    // other readers share the locks, so read only through const methods,
+    // which never touch the strings' caches
+    std::string text;
+    for (const std::unique_ptr<Segment>& segment : segments_)
+    {
+        const ChunkyString& chars = segment->text_;
+        text.append(chars.begin(), chars.end());
+    }
+    return text;
+}
+
+size_t ConcurrentChunkyString::segments() const
+{
+    SharedLock structure(structure_);
+    return segments_.size();
+}
+
+bool ConcurrentChunkyString::outOfShape(size_t size)
+{
+    return size == 0 || size > 2 * SEGMENT_SIZE;
+}
+
+void ConcurrentChunkyString::rebalance()
+{
+    // nobody else holds a segment while we hold structure_
+    std::lock_guard<SharedMutex> structure(structure_);
+
+    std::vector<std::unique_ptr<Segment>> reshaped;
+    for (std::unique_ptr<Segment>& segment : segments_)
+    {
+        ChunkyString& text = segment->text_;
+        if (text.size() == 0)
+        {
+            continue;
+        }
+        if (text.size() <= 2 * SEGMENT_SIZE)
+        {
+            reshaped.push_back(std::move(segment));
+            continue;
+        }
+
+        // cut into SEGMENT_SIZE pieces, the last taking the remainder
+        std::string chars(text.begin(), text.end());
+        size_t pieces = chars.size() / SEGMENT_SIZE;
+        for (size_t piece = 0; piece < pieces; ++piece)
+        {
+            size_t from = piece * SEGMENT_SIZE;
+            size_t length = piece + 1 == pieces ? chars.size() - from
+                                                : SEGMENT_SIZE;
+            std::unique_ptr<Segment> part(new Segment());
+            part->text_.assign(chars.data() + from, length, 1);
+            reshaped.push_back(std::move(part));
+        }
+    }
+    if (reshaped.empty())
+    {
+        reshaped.push_back(std::unique_ptr<Segment>(new Segment()));
+    }
+    segments_.swap(reshaped);
+
+    sizes_.clear();
+    for (const std::unique_ptr<Segment>& segment : segments_)
+    {
+        sizes_.push_back(segment->text_.size());
+    }
+}
+
+// ---------------------------------------------
+// Implementation of AppendOnlyChunkyString
+// ---------------------------------------------
+//
+const size_t AppendOnlyChunkyString::BLOCK_SIZE;
+const size_t AppendOnlyChunkyString::npos;
+
+AppendOnlyChunkyString::Block::Block(size_t capacity, size_t reserved)
+    : capacity_{capacity}, chars_{new char[capacity]}, reserved_{reserved},
+      committed_{0}, published_{0}, sealed_{npos}, next_{nullptr}
+{
+    // Nothing to do here!
+}
+
+AppendOnlyChunkyString::AppendOnlyChunkyString()
+    : head_{new Block(BLOCK_SIZE, 0)}, tail_{head_}
+{
+    // Nothing to do here!
+}
+
+AppendOnlyChunkyString::~AppendOnlyChunkyString()
+{
+    Block* block = head_;
+    while (block != nullptr)
+    {
+        Block* next = block->next_.load(std::memory_order_relaxed);
+        delete block;
+        block = next;
+    }
+}
+
+void AppendOnlyChunkyString::append(const char* s, size_t n)
+{
+    if (n == 0)
+    {
+        return;
+    }
+
+    for (;;)
+    {
+        Block* tail = tail_.load(std::memory_order_acquire);
+        size_t at = tail->reserved_.fetch_add(n, std::memory_order_relaxed);
+        if (at + n <= tail->capacity_)
+        {
+            fill(*tail, at, s, n);
+            return;
+        }
+
+        // Reservations only grow, so exactly one failed one starts where
+        // the successful ones stop; it seals the block, and publishes it
+        // if the last copy into it finished before the seal was visible
+        if (at <= tail->capacity_)
+        {
+            tail->sealed_.store(at);
+            publish(*tail, tail->committed_.load());
+        }
+
+        Block* next = tail->next_.load(std::memory_order_acquire);
+        if (next == nullptr)
+        {
+            // Link a block with our room already taken, so we can't lose
+            // it to another appender
+            Block* fresh = new Block(std::max(size_t(BLOCK_SIZE), n), n);
+            if (tail->next_.compare_exchange_strong(
+                    next, fresh, std::memory_order_acq_rel,
+                    std::memory_order_acquire))
+            {
+                tail_.compare_exchange_strong(tail, fresh,
+                                              std::memory_order_release,
+                                              std::memory_order_relaxed);
+                fill(*fresh, 0, s, n);
+                return;
+            }
+            delete fresh;
+        }
+
+        // Help whoever linked next in moving tail_ along, then try there
+        tail_.compare_exchange_strong(tail, next, std::memory_order_release,
+                                      std::memory_order_relaxed);
+    }
+}
+
+void AppendOnlyChunkyString::fill(Block& block, size_t at, const char* s,
+                                  size_t n)
+{
+    std::memcpy(block.chars_.get() + at, s, n);
+    publish(block, block.committed_.fetch_add(n) + n);
+}
+
+void AppendOnlyChunkyString::publish(Block& block, size_t committed)
+{
+    // Everything reserved so far is copied once the count catches up with
+    // the reservations; if another append is still copying, it publishes
+    // when it finishes. The sequentially consistent committed_, reserved_
+    // and sealed_ accesses make sure the last one to finish sees the rest.
+    size_t end = block.sealed_.load();
+    if (end == npos)
+    {
+        end = std::min(block.reserved_.load(), block.capacity_);
+    }
+    if (committed != end)
+    {
+        return;
+    }
+
+    size_t published = block.published_.load(std::memory_order_relaxed);
+    while (published < committed
+           && !block.published_.compare_exchange_weak(
+                  published, committed, std::memory_order_release,
+                  std::memory_order_relaxed))
+    {
+        // Someone else published; try again unless they got further
+    }
+}
+
+void AppendOnlyChunkyString::push_back(char c)
+{
+    append(&c, 1);
+}
+
+AppendOnlyChunkyString&
+    AppendOnlyChunkyString::operator+=(const std::string& text)
+{
+    append(text.data(), text.size());
+    return *this;
+}
+
+size_t AppendOnlyChunkyString::size() const
+{
+    size_t size = 0;
+    for (const Block* block = head_; block != nullptr;
+         block = block->next_.load(std::memory_order_acquire))
+    {
+        size_t published = block->published_.load(std::memory_order_acquire);
+        size += published;
+
+        // Later blocks count only once all of this one is published
+        if (published != block->sealed_.load(std::memory_order_acquire))
+        {
+            break;
+        }
+    }
+    return size;
+}
+
+AppendOnlyChunkyString::const_iterator AppendOnlyChunkyString::begin() const
+{
+    return const_iterator(head_, size());
+}
+
+AppendOnlyChunkyString::const_iterator AppendOnlyChunkyString::end() const
+{
+    return const_iterator();
+}
+
+std::string AppendOnlyChunkyString::str() const
+{
+    return std::string(begin(), end());
+}
+
+AppendOnlyChunkyString::const_iterator::const_iterator()
+    : block_{nullptr}, index_{0}, limit_{0}, remaining_{0}
+{
+    // Nothing to do here!
+}
+
+AppendOnlyChunkyString::const_iterator::const_iterator(const Block* block,
+                                                       size_t remaining)
+    : block_{block}, index_{0}, limit_{0}, remaining_{remaining}
+{
+    if (remaining_ != 0)
+    {
+        limit_ = block_->published_.load(std::memory_order_acquire);
+        settle();
+    }
+}
+
+void AppendOnlyChunkyString::const_iterator::settle()
+{
+    // Every block before the last one visited was sealed when size()
+    // counted it, so its published length is final
+    while (remaining_ != 0 && index_ == limit_)
+    {
+        block_ = block_->next_.load(std::memory_order_acquire);
+        index_ = 0;
+        limit_ = block_->published_.load(std::memory_order_acquire);
+    }
+}
+
+AppendOnlyChunkyString::const_iterator&
+    AppendOnlyChunkyString::const_iterator::operator++()
+{
+    ++index_;
+    --remaining_;
+    settle();
+    return *this;
+}
+
+AppendOnlyChunkyString::const_iterator
+    AppendOnlyChunkyString::const_iterator::operator++(int)
+{
+    const_iterator old = *this;
+    ++*this;
+    return old;
+}
+
+AppendOnlyChunkyString::const_iterator::reference
+    AppendOnlyChunkyString::const_iterator::operator*() const
+{
+    return block_->chars_[index_];
+}
+
+bool AppendOnlyChunkyString::const_iterator::operator==(
+    const const_iterator& rhs) const
+{
+    return remaining_ == rhs.remaining_;
+}
+
+bool AppendOnlyChunkyString::const_iterator::operator!=(
+    const const_iterator& rhs) const
+{
+    return !(*this == rhs);
+}
@@ -0,0 +1,293 @@
+/**
+ * \file concurrentchunkystring.hpp
+ *
+ * \authors Ricky Pan, Iris Liu
+ *
+ * \brief Declares ConcurrentChunkyString, a ChunkyString that many threads
+ *        may edit at once, the SharedMutex it locks with, and
+ *        AppendOnlyChunkyString, which many threads may append to without
+ *        locking.
+ */
+
+#ifndef CONCURRENTCHUNKYSTRING_HPP_INCLUDED
+#define CONCURRENTCHUNKYSTRING_HPP_INCLUDED 1
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "chunkystring.hpp"
+
+/**
+ * \class SharedMutex
+ * \brief A readers-writer lock, since C++11 has no `std::shared_mutex`.
+ *
+ * \details Any number of threads may hold it shared, or one thread
+ *          exclusively. Waiting writers go first: once one is waiting, new
+ *          shared lockers wait too, so a steady stream of readers can't
+ *          starve it.
+ *
+ *          lock() and unlock() make it a Lockable, so `std::lock_guard`
+ *          and `std::unique_lock` work for the exclusive side.
+ */
+class SharedMutex {
+public:
+    SharedMutex();
+
+    SharedMutex(const SharedMutex&) = delete;
+    SharedMutex& operator=(const SharedMutex&) = delete;
+
+    void lock();            ///< Lock exclusively
+    void unlock();          ///< Release an exclusive lock
+    void lock_shared();     ///< Lock shared
+    void unlock_shared();   ///< Release a shared lock
+
+private:
+    std::mutex mutex_;
+    std::condition_variable readersMayGo_;
+    std::condition_variable writerMayGo_;
+    size_t readers_;            // threads holding it shared
+    size_t waitingWriters_;
+    bool writing_;              // a thread holds it exclusively
+};
+
+/**
+ * \class ConcurrentChunkyString
+ * \brief A string that several threads may read and edit at once.
+ *
+ * \details The text is split into segments of about SEGMENT_SIZE
+ *          characters, each a ChunkyString with a SharedMutex of its own.
+ *          A table of the segments' sizes, under a mutex of its own, maps
+ *          offsets to segments. An edit holds the table only while it
+ *          looks up its offset, locks the segments it changes exclusively
+ *          and records its change in their sizes; it then makes the
+ *          change with the table released. Edits in different segments
+ *          thus run in parallel, whatever their positions, and the order
+ *          edits take the table in is the order they happen in.
+ *
+ *          An edit whose segment another edit is still changing waits for
+ *          it while holding the table, and so holds up the edits that
+ *          come after it until then, wherever they are. Appends lock only
+ *          the last segment, but go through the table too.
+ *
+ *          Readers take the table, then every segment shared, so what
+ *          they see is the string as it was between two edits; they too
+ *          hold up new edits while waiting for those under way.
+ *
+ *          Only threads holding the table lock segments, so threads can't
+ *          deadlock. Once a segment grows past twice SEGMENT_SIZE, or
+ *          empties, the edit that did it waits for the others to finish
+ *          and then splits or drops it, holding a lock over the list of
+ *          segments.
+ */
+class ConcurrentChunkyString {
+public:
+    /// Characters per segment after a split
+    static const size_t SEGMENT_SIZE = 4096;
+
+    /// Default constructor: empty, one segment
+    ConcurrentChunkyString();
+
+    ConcurrentChunkyString(const ConcurrentChunkyString&) = delete;
+    ConcurrentChunkyString& operator=(const ConcurrentChunkyString&) = delete;
+
+    /**
+     * \brief Insert text before the character at offset
+     *
+     * \throws std::out_of_range if offset is past the end
+     */
+    void insert(size_t offset, const std::string& text);
+
+    /**
+     * \brief Erase count characters starting at offset
+     *
+     * \throws std::out_of_range if they reach past the end
+     */
+    void erase(size_t offset, size_t count);
+
+    /// Append c
+    void push_back(char c);
+
+    /// Append text
+    ConcurrentChunkyString& operator+=(const std::string& text);
+
+    /// Number of characters \note linear in the number of segments
+    size_t size() const;
+
+    /// The whole string, as it was between two edits
+    std::string str() const;
+
+    /// Number of segments the string is split into
+    size_t segments() const;
+
+private:
+    /// Part of the string, with the lock that guards it
+    struct Segment {
+        mutable SharedMutex lock_;
+        ChunkyString text_;
+    };
+
+    class Locks;
+
+    /**
+     * \brief Lock the segments an edit that erases count characters at
+     *        offset, or inserts inserted characters there, changes
+     *
+     * \details An offset between two segments goes to the end of the
+     *          first. The first segment touched and the offset in it are
+     *          returned through first and local. The edit's change in
+     *          size is recorded in sizes_ before returning, so the caller
+     *          must go on to make it.
+     *
+     * \throws std::out_of_range if the edit reaches past the end
+     */
+    void lockFor(size_t offset, size_t count, size_t inserted, Locks& locks,
+                 size_t& first, size_t& local);
+
+    /// Split oversized segments and drop empty ones, holding structure_
+    /// exclusively
+    void rebalance();
+
+    /// Whether a segment of this size should be split or dropped
+    static bool outOfShape(size_t size);
+
+    // Held shared by every operation, and exclusively by rebalance()
+    mutable SharedMutex structure_;
+    std::vector<std::unique_ptr<Segment>> segments_;
+
+    // Size of each segment once the edits that have locked it are done;
+    // only touched while holding index_ (or structure_ exclusively)
+    mutable std::mutex index_;
+    std::vector<size_t> sizes_;
+};
+
+/**
+ * \class AppendOnlyChunkyString
+ * \brief A string that many threads may append to at once, without
+ *        locking, for logs and the like.
+ *
+ * \details The text is kept in a list of blocks of BLOCK_SIZE characters.
+ *          An append reserves room in the last block with one atomic add,
+ *          and copies its characters there alongside other appends. If the
+ *          block is full, the appender links a fresh block after it with a
+ *          compare-and-swap; whoever loses the race uses the winner's.
+ *          Each append lands in one piece, never interleaved with another.
+ *
+ *          No append waits for another. Each block counts the characters
+ *          copied into it, and whichever append brings that count up to
+ *          the room reserved so far publishes everything up to there.
+ *          Readers see the published prefix of the string, which only
+ *          grows: begin() iterates over the prefix as it was when begin()
+ *          was called. While appends keep overlapping, a block may stay
+ *          unpublished until they pause or it fills, so readers can lag
+ *          writers by up to a block.
+ *
+ * \note Nothing is ever erased; blocks go when the string does.
+ */
+class AppendOnlyChunkyString {
+private:
+    struct Block;
+
+public:
+    /// Characters per block; a longer append gets a block of its own size
+    static const size_t BLOCK_SIZE = 4096;
+
+    /**
+     * \class const_iterator
+     * \brief Forward iterator over the prefix published when begin() was
+     *        called
+     */
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = char;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const char*;
+        using reference = const char&;
+
+        /// Default constructor: equal to end()
+        const_iterator();
+
+        const_iterator& operator++();
+        const_iterator operator++(int);
+        reference operator*() const;
+
+        /// Only iterators from the same begin() compare meaningfully
+        bool operator==(const const_iterator& rhs) const;
+        bool operator!=(const const_iterator& rhs) const;
+
+    private:
+        friend class AppendOnlyChunkyString;
+        const_iterator(const Block* block, size_t remaining);
+
+        /// Move on to the next block while this one has no more characters
+        void settle();
+
+        const Block* block_;
+        size_t index_;          // in block_
+        size_t limit_;          // characters block_ holds
+        size_t remaining_;      // characters left to visit
+    };
+
+    /// Default constructor: empty, one block
+    AppendOnlyChunkyString();
+    ~AppendOnlyChunkyString();
+
+    AppendOnlyChunkyString(const AppendOnlyChunkyString&) = delete;
+    AppendOnlyChunkyString& operator=(const AppendOnlyChunkyString&) = delete;
+
+    /// Append n characters from s, in one piece
+    void append(const char* s, size_t n);
+
+    /// Append c
+    void push_back(char c);
+
+    /// Append text, in one piece
+    AppendOnlyChunkyString& operator+=(const std::string& text);
+
+    /// Number of characters published \note linear in the number of blocks
+    size_t size() const;
+
+    /// Start of the prefix published so far
+    const_iterator begin() const;
+    const_iterator end() const;
+
+    /// The prefix published so far
+    std::string str() const;
+
+private:
+    /// Room for appends; full blocks are sealed and point to the next
+    struct Block {
+        explicit Block(size_t capacity, size_t reserved);
+
+        Block(const Block&) = delete;
+        Block& operator=(const Block&) = delete;
+
+        const size_t capacity_;
+        std::unique_ptr<char[]> chars_;
+        std::atomic<size_t> reserved_;     // room handed out; may overshoot
+        std::atomic<size_t> committed_;    // characters copied in
+        std::atomic<size_t> published_;    // characters readers may see
+        std::atomic<size_t> sealed_;       // final length once full, or npos
+        std::atomic<Block*> next_;
+    };
+
+    static const size_t npos = size_t(-1);
+
+    /// Copy n characters from s to block at offset at, and publish them
+    /// if nothing before them is still being copied
+    static void fill(Block& block, size_t at, const char* s, size_t n);
+
+    /// Publish block up to committed if that is all the room reserved
+    static void publish(Block& block, size_t committed);
+
+    Block* const head_;
+    std::atomic<Block*> tail_;     // the last block, or one just before it
+};
+
+#endif // CONCURRENTCHUNKYSTRING_HPP_INCLUDED
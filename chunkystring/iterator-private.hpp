@@ -10,21 +10,34 @@
 
 template <bool const_it>
 ChunkyString::Iterator<const_it>::Iterator()
+    : cur_{nullptr}, chunkEnd_{nullptr}, owner_{nullptr}
 {
     // Nothing to do here..
 }
 
 template <bool const_it>
 ChunkyString::Iterator<const_it>::Iterator(list_iterator_type chunk,
-                                             size_t charIndex)
+                                             size_t charIndex,
+                                             owner_type owner)
+    : chunk_{chunk}, owner_{owner}
 {
-    chunk_ = chunk;
-    charInd_ = charIndex;
+    // one past a chunk's last character is the next chunk's first
+    if (chunk_ != owner_->chunks_.end() && charIndex == chunk_->length_)
+    {
+        ++chunk_;
+        charIndex = 0;
+    }
+    enterChunk();
+    if (cur_ != nullptr)
+    {
+        cur_ += charIndex;
+    }
 }
 
 template <bool const_it>
 ChunkyString::Iterator<const_it>::Iterator(const Iterator<false>& i)
-    : chunk_{i.chunk_}, charInd_{i.charInd_}
+    : chunk_{i.chunk_}, cur_{i.cur_}, chunkEnd_{i.chunkEnd_}, 
+      owner_{i.owner_}
 {
     // Nothing to do here!
 }
@@ -33,20 +46,21 @@ template <bool const_it>
 ChunkyString::Iterator<const_it>& ChunkyString::Iterator<const_it>::operator++()
 {
     // sets the iterator to point to the next char in the ChunkyString
+    if (++cur_ != chunkEnd_)
+    {
+        return *this;
+    }
 
-    // case for iterator points to last char in Chunk
-    if(charInd_ == chunk_->length_-1)
+    // push_back may have grown the chunk since chunkEnd_ was cached
+    chunkEnd_ = chunk_->chars_ + chunk_->length_;
+    if (cur_ == chunkEnd_)
     {
         // set iterator to point to first char of next Chunk
         // if iterator pointed to last char, it will be equal to the
         // end iterator
         ++chunk_;
-        charInd_ = 0;
+        enterChunk();
     }
-    else
-    {
-        ++charInd_;
-    } 
     return *this;
 }
 
@@ -56,32 +70,40 @@ ChunkyString::Iterator<const_it>&
 {
     // sets the iterator to point to the previous char in ChunkyString
 
-    if (charInd_ == 0)
+    if (cur_ == nullptr || cur_ == chunk_->chars_)
     {
         --chunk_;
-        charInd_ = chunk_->length_-1;
+        chunkEnd_ = chunk_->chars_ + chunk_->length_;
+        cur_ = chunkEnd_ - 1;
     }
     else
     {
-        --charInd_;
+        --cur_;
     }
     return *this;
 }
 
-template <bool const_it>
-typename ChunkyString::Iterator<const_it>::reference 
-    ChunkyString::Iterator<const_it>::operator*() const
+template <>
+inline ChunkyString::Iterator<true>::reference 
+    ChunkyString::Iterator<true>::operator*() const
 {
-    // Return the char curr_ points to
-    return chunk_->chars_[charInd_];
+    // Return the char cur_ points to
+    return *cur_;
+}
+
+template <>
+inline ChunkyString::Iterator<false>::reference 
+    ChunkyString::Iterator<false>::operator*() const
+{
+    // Writes go through the reference, which keeps the caches current
+    return CharReference(cur_, &*chunk_, owner_);
 }
 
 template <bool const_it>
 bool ChunkyString::Iterator<const_it>::operator==(const Iterator& rhs) const
 {
-    // Checks if two iterators hold the same Chunk address and same
-    // location within the array
-    return chunk_ == rhs.chunk_ && charInd_ == rhs.charInd_;  
+    // Every character has its own address, and end() has none
+    return cur_ == rhs.cur_;
 }
 
 template <bool const_it>
@@ -90,3 +112,42 @@ bool ChunkyString::Iterator<const_it>::operator!=(const Iterator& rhs) const
     // leverage == to implement !=
     return !(*this == rhs); 
 }
+
+template <bool const_it>
+void ChunkyString::Iterator<const_it>::enterChunk()
+{
+    if (chunk_ == owner_->chunks_.end())
+    {
+        cur_ = nullptr;
+        chunkEnd_ = nullptr;
+    }
+    else
+    {
+        cur_ = chunk_->chars_;
+        chunkEnd_ = cur_ + chunk_->length_;
+    }
+}
+
+template <bool const_it>
+size_t ChunkyString::Iterator<const_it>::index() const
+{
+    return cur_ - chunk_->chars_;
+}
+
+inline ChunkyString::CharReference::CharReference(char* c, Chunk* chunk,
+                                                  ChunkyString* owner)
+    : char_{c}, chunk_{chunk}, owner_{owner}
+{
+    // Nothing to do here!
+}
+
+inline ChunkyString::CharReference::operator char() const
+{
+    return *char_;
+}
+
+inline ChunkyString::CharReference& 
+    ChunkyString::CharReference::operator=(const CharReference& other)
+{
+    return *this = char(other);
+}
@@ -0,0 +1,685 @@
+/**
+ * \file stringbench.cpp
+ *
+ * \authors Ricky Pan, Iris Liu
+ *
+ * \brief Microbenchmarks for ChunkyString, compared against std::string,
+ *        std::deque<char> and std::list<char>.
+ *
+ * \details Modeled on Google Benchmark, which isn't available on the
+ *          course machines: each benchmark body loops on
+ *          State::keepRunning(), which runs it in doubling batches until
+ *          it has taken at least the minimum time, then reports the mean
+ *          time per iteration.
+ *
+ *          Usage:
+ *
+ *              ./stringbench [--max-size=N] [--filter=TEXT]
+ *                            [--min-time=SECONDS] [--csv]
+ *
+ *          Sizes run from 10 up to --max-size (default 10^6) by powers of
+ *          ten. Sizes up to 10^8 work, but std::list<char> then needs
+ *          several gigabytes. --filter runs only benchmarks whose name
+ *          contains TEXT; --csv prints comma-separated output for
+ *          comparing runs.
+ */
+
+#include "chunkystring.hpp"
+#include "concurrentchunkystring.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::size_t;
+
+namespace {
+
+/// Keeps the optimizer from discarding results we never look at.
+volatile size_t sink;
+
+/**
+ * \class State
+ * \brief Controls the timing loop of one benchmark at one size.
+ */
+class State {
+public:
+    explicit State(size_t size, double minTime);
+
+    /// True while the body should run again; starts and stops the clock
+    bool keepRunning();
+
+    /// Exclude setup inside the loop from the measurement
+    void pauseTiming();
+    void resumeTiming();
+
+    /// Report bytes handled per iteration, to print a throughput
+    void setBytesPerIteration(size_t bytes);
+
+    size_t size() const;
+    size_t iterations() const;
+    double nsPerIteration() const;
+    double bytesPerSecond() const;
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    static const size_t MAX_ITERATIONS = 1000000000;
+
+    size_t size_;
+    double minTime_;
+    size_t iterations_;
+    size_t remaining_;      // iterations left in the current batch
+    size_t bytes_;
+    bool running_;
+    clock::time_point start_;
+    clock::duration elapsed_;
+};
+
+State::State(size_t size, double minTime)
+    : size_{size}, minTime_{minTime}, iterations_{0}, remaining_{0},
+      bytes_{0}, running_{false}, elapsed_{clock::duration::zero()}
+{
+    // Nothing to do here!
+}
+
+bool State::keepRunning()
+{
+    if (remaining_ == 0)
+    {
+        // only look at the clock between batches
+        pauseTiming();
+        double seconds = std::chrono::duration<double>(elapsed_).count();
+        if (iterations_ != 0
+            && (seconds >= minTime_ || iterations_ >= MAX_ITERATIONS))
+        {
+            return false;
+        }
+        remaining_ = std::max<size_t>(iterations_, 1);
+        resumeTiming();
+    }
+    --remaining_;
+    ++iterations_;
+    return true;
+}
+
+void State::pauseTiming()
+{
+    if (running_)
+    {
+        elapsed_ += clock::now() - start_;
+        running_ = false;
+    }
+}
+
+void State::resumeTiming()
+{
+    if (!running_)
+    {
+        running_ = true;
+        start_ = clock::now();
+    }
+}
+
+void State::setBytesPerIteration(size_t bytes)
+{
+    bytes_ = bytes;
+}
+
+size_t State::size() const
+{
+    return size_;
+}
+
+size_t State::iterations() const
+{
+    return iterations_;
+}
+
+double State::nsPerIteration() const
+{
+    return std::chrono::duration<double, std::nano>(elapsed_).count()
+           / iterations_;
+}
+
+double State::bytesPerSecond() const
+{
+    return bytes_ * 1e9 / nsPerIteration();
+}
+
+// ---- The few operations that differ between the string types ----
+
+template <typename S>
+void append(S& s, const S& other)
+{
+    s.insert(s.end(), other.begin(), other.end());
+}
+
+void append(ChunkyString& s, const ChunkyString& other)
+{
+    s += other;
+}
+
+void append(std::string& s, const std::string& other)
+{
+    s += other;
+}
+
+template <typename S>
+void print(std::ostream& out, const S& s)
+{
+    std::copy(s.begin(), s.end(), std::ostreambuf_iterator<char>(out));
+}
+
+void print(std::ostream& out, const ChunkyString& s)
+{
+    out << s;
+}
+
+void print(std::ostream& out, const std::string& s)
+{
+    out << s;
+}
+
+template <typename S, typename F>
+void forEach(const S& s, F f)
+{
+    std::for_each(s.begin(), s.end(), f);
+}
+
+template <typename F>
+void forEach(const ChunkyString& s, F f)
+{
+    s.for_each_char(f);
+}
+
+template <typename S>
+size_t find(const S& s, const std::string& pattern)
+{
+    return std::search(s.begin(), s.end(), pattern.begin(), pattern.end())
+           - s.begin();
+}
+
+template <typename T>
+size_t find(const std::list<T>& s, const std::string& pattern)
+{
+    return std::distance(s.begin(), std::search(s.begin(), s.end(),
+                                                pattern.begin(),
+                                                pattern.end()));
+}
+
+size_t find(const ChunkyString& s, const std::string& pattern)
+{
+    return s.find(pattern);
+}
+
+size_t find(const std::string& s, const std::string& pattern)
+{
+    return s.find(pattern);
+}
+
+/// A string of the given size, built with push_back
+template <typename S>
+S make(size_t size)
+{
+    S s;
+    for (size_t i = 0; i < size; ++i)
+    {
+        s.push_back('a' + i % 26);
+    }
+    return s;
+}
+
+// ---- Benchmarks ----
+
+template <typename S>
+void pushBack(State& state)
+{
+    while (state.keepRunning())
+    {
+        S s;
+        for (size_t i = 0; i < state.size(); ++i)
+        {
+            s.push_back('a' + i % 26);
+        }
+        sink = s.size();
+    }
+    state.setBytesPerIteration(state.size());
+}
+
+/// Where insertEraseAt() edits the string
+enum class Where { FRONT, MIDDLE, BACK, RANDOM };
+
+/// Insert a character and erase it again, finding the spot from begin()
+template <typename S, Where where>
+void insertEraseAt(State& state)
+{
+    S s = make<S>(state.size());
+
+    // positions are drawn ahead of time to keep the generator out of the
+    // measurement
+    std::vector<size_t> positions(1024);
+    std::mt19937 rng(42);
+    std::uniform_int_distribution<size_t> any(0, state.size());
+    for (size_t& position : positions)
+    {
+        position = where == Where::FRONT  ? 0
+                 : where == Where::MIDDLE ? state.size() / 2
+                 : where == Where::BACK   ? state.size()
+                 :                          any(rng);
+    }
+
+    size_t next = 0;
+    while (state.keepRunning())
+    {
+        typename S::iterator i = s.begin();
+        std::advance(i, positions[next++ % positions.size()]);
+        i = s.insert(i, '!');
+        s.erase(i);
+    }
+    sink = s.size();
+}
+
+template <typename S>
+void iterate(State& state)
+{
+    const S s = make<S>(state.size());
+    while (state.keepRunning())
+    {
+        size_t sum = 0;
+        for (char c : s)
+        {
+            sum += c;
+        }
+        sink = sum;
+    }
+    state.setBytesPerIteration(state.size());
+}
+
+template <typename S>
+void visit(State& state)
+{
+    // for_each_char where there is one, std::for_each elsewhere
+    const S s = make<S>(state.size());
+    while (state.keepRunning())
+    {
+        size_t sum = 0;
+        forEach(s, [&sum](char c) { sum += c; });
+        sink = sum;
+    }
+    state.setBytesPerIteration(state.size());
+}
+
+template <typename S>
+void equal(State& state)
+{
+    // equal strings are the worst case: every character is compared
+    const S a = make<S>(state.size());
+    const S b = make<S>(state.size());
+    while (state.keepRunning())
+    {
+        sink = (a == b);
+    }
+    state.setBytesPerIteration(state.size());
+}
+
+template <typename S>
+void search(State& state)
+{
+    // the pattern never occurs, but its first two letters often do
+    const S s = make<S>(state.size());
+    while (state.keepRunning())
+    {
+        sink = find(s, "abd");
+    }
+    state.setBytesPerIteration(state.size());
+}
+
+void searchParallel(State& state)
+{
+    const ChunkyString s = make<ChunkyString>(state.size());
+    while (state.keepRunning())
+    {
+        sink = s.parallel_find("abd");
+    }
+    state.setBytesPerIteration(state.size());
+}
+
+void countParallel(State& state)
+{
+    const ChunkyString s = make<ChunkyString>(state.size());
+    while (state.keepRunning())
+    {
+        sink = s.parallel_count("ab");
+    }
+    state.setBytesPerIteration(state.size());
+}
+
+void assignParallel(State& state)
+{
+    const std::string source = make<std::string>(state.size());
+    ChunkyString s;
+    while (state.keepRunning())
+    {
+        s.assign(source.data(), source.size());
+        sink = s.size();
+    }
+    state.setBytesPerIteration(state.size());
+}
+
+void equalParallel(State& state)
+{
+    const ChunkyString a = make<ChunkyString>(state.size());
+    const ChunkyString b = make<ChunkyString>(state.size());
+    while (state.keepRunning())
+    {
+        sink = a.parallel_equal(b);
+    }
+    state.setBytesPerIteration(state.size());
+}
+
+/// A ChunkyString behind a mutex, the usual way to share a log
+class LockedChunkyString {
+public:
+    void append(const char* s, size_t n)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        text_.replace(text_.end(), text_.end(), s, n);
+    }
+
+    size_t size() const
+    {
+        return text_.size();
+    }
+
+private:
+    std::mutex mutex_;
+    ChunkyString text_;
+};
+
+template <typename Log>
+void appendConcurrent(State& state)
+{
+    // four threads share out the records, logging-style
+    const size_t THREADS = 4;
+    const std::string record = "log record 0123\n";
+    const size_t records = state.size() / record.size();
+    while (state.keepRunning())
+    {
+        Log log;
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < THREADS; ++t)
+        {
+            threads.push_back(std::thread([&log, &record, records, t] {
+                for (size_t i = t; i < records; i += THREADS)
+                {
+                    log.append(record.data(), record.size());
+                }
+            }));
+        }
+        for (std::thread& thread : threads)
+        {
+            thread.join();
+        }
+        sink = log.size();
+    }
+    state.setBytesPerIteration(records * record.size());
+}
+
+template <typename S>
+void less(State& state)
+{
+    const S a = make<S>(state.size());
+    const S b = make<S>(state.size());
+    while (state.keepRunning())
+    {
+        sink = (a < b);
+    }
+    state.setBytesPerIteration(state.size());
+}
+
+template <typename S>
+void appendTo(State& state)
+{
+    const S s = make<S>(state.size());
+    while (state.keepRunning())
+    {
+        state.pauseTiming();
+        S target(s);
+        state.resumeTiming();
+        append(target, s);
+        sink = target.size();
+
+        // destroying target isn't part of the append
+        state.pauseTiming();
+    }
+    state.setBytesPerIteration(state.size());
+}
+
+template <typename S>
+void copy(State& state)
+{
+    const S s = make<S>(state.size());
+    while (state.keepRunning())
+    {
+        S copy(s);
+        sink = copy.size();
+    }
+    state.setBytesPerIteration(state.size());
+}
+
+template <typename S>
+void output(State& state)
+{
+    const S s = make<S>(state.size());
+    std::ostringstream out;
+    while (state.keepRunning())
+    {
+        out.str("");
+        print(out, s);
+        sink = static_cast<size_t>(out.tellp());
+    }
+    state.setBytesPerIteration(state.size());
+}
+
+template <typename S>
+void manySmall(State& state)
+{
+    // many short strings alive at once, like the words of a document;
+    // measures construction, destruction and the size of the objects
+    const std::string word = "word";
+    while (state.keepRunning())
+    {
+        std::vector<S> words(state.size());
+        for (S& w : words)
+        {
+            for (char c : word)
+            {
+                w.push_back(c);
+            }
+        }
+        sink = words.size();
+    }
+    state.setBytesPerIteration(state.size() * word.size());
+}
+
+/// One benchmark for one string type
+struct Benchmark {
+    std::string name_;
+    std::function<void(State&)> run_;
+};
+
+/// Adds every benchmark for string type S to benchmarks
+template <typename S>
+void addAll(std::vector<Benchmark>& benchmarks, const std::string& type)
+{
+    benchmarks.push_back({"push_back/" + type, pushBack<S>});
+    benchmarks.push_back({"insert_erase_front/" + type,
+                          insertEraseAt<S, Where::FRONT>});
+    benchmarks.push_back({"insert_erase_middle/" + type,
+                          insertEraseAt<S, Where::MIDDLE>});
+    benchmarks.push_back({"insert_erase_back/" + type,
+                          insertEraseAt<S, Where::BACK>});
+    benchmarks.push_back({"insert_erase_random/" + type,
+                          insertEraseAt<S, Where::RANDOM>});
+    benchmarks.push_back({"iterate/" + type, iterate<S>});
+    benchmarks.push_back({"visit/" + type, visit<S>});
+    benchmarks.push_back({"equal/" + type, equal<S>});
+    benchmarks.push_back({"less/" + type, less<S>});
+    benchmarks.push_back({"find/" + type, search<S>});
+    benchmarks.push_back({"append/" + type, appendTo<S>});
+    benchmarks.push_back({"copy/" + type, copy<S>});
+    benchmarks.push_back({"output/" + type, output<S>});
+    benchmarks.push_back({"many_small/" + type, manySmall<S>});
+}
+
+/// Value of a --name=value option, or nullptr if arg isn't that option
+const char* option(const char* arg, const char* name)
+{
+    size_t length = std::strlen(name);
+    if (std::strncmp(arg, name, length) == 0 && arg[length] == '=')
+    {
+        return arg + length + 1;
+    }
+    return nullptr;
+}
+
+} // end of anonymous namespace
+
+int main(int argc, char** argv)
+{
+    size_t maxSize = 1000000;
+    double minTime = 0.2;
+    std::string filter;
+    bool csv = false;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (const char* value = option(argv[i], "--max-size"))
+        {
+            maxSize = std::strtoull(value, nullptr, 10);
+        }
+        else if (const char* value = option(argv[i], "--min-time"))
+        {
+            minTime = std::strtod(value, nullptr);
+        }
+        else if (const char* value = option(argv[i], "--filter"))
+        {
+            filter = value;
+        }
+        else if (std::strcmp(argv[i], "--csv") == 0)
+        {
+            csv = true;
+        }
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--max-size=N]"
+                      << " [--filter=TEXT] [--min-time=SECONDS] [--csv]"
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<Benchmark> benchmarks;
+    addAll<ChunkyString>(benchmarks, "ChunkyString");
+    addAll<std::string>(benchmarks, "string");
+    addAll<std::deque<char>>(benchmarks, "deque");
+    addAll<std::list<char>>(benchmarks, "list");
+
+    // only ChunkyString has parallel and concurrent variants
+    benchmarks.push_back({"assign_parallel/ChunkyString", assignParallel});
+    benchmarks.push_back({"equal_parallel/ChunkyString", equalParallel});
+    benchmarks.push_back({"find_parallel/ChunkyString", searchParallel});
+    benchmarks.push_back({"count_parallel/ChunkyString", countParallel});
+    benchmarks.push_back({"append_concurrent/ChunkyString+mutex",
+                          appendConcurrent<LockedChunkyString>});
+    benchmarks.push_back({"append_concurrent/AppendOnlyChunkyString",
+                          appendConcurrent<AppendOnlyChunkyString>});
+
+    // group by operation, then size, so the string types sit side by side
+    std::stable_sort(benchmarks.begin(), benchmarks.end(),
+                     [](const Benchmark& a, const Benchmark& b) {
+                         return a.name_.substr(0, a.name_.find('/'))
+                                < b.name_.substr(0, b.name_.find('/'));
+                     });
+
+    if (csv)
+    {
+        std::cout << "name,size,iterations,ns_per_iteration,bytes_per_second"
+                  << std::endl;
+    }
+    else
+    {
+        std::cout << std::left << std::setw(44) << "Benchmark"
+                  << std::right << std::setw(16) << "Time (ns)"
+                  << std::setw(14) << "Iterations"
+                  << std::setw(14) << "MB/s" << std::endl
+                  << std::string(88, '-') << std::endl;
+    }
+
+    for (size_t i = 0; i < benchmarks.size();)
+    {
+        // benchmarks [i, end) are one operation on every string type
+        std::string operation =
+            benchmarks[i].name_.substr(0, benchmarks[i].name_.find('/'));
+        size_t end = i;
+        while (end < benchmarks.size()
+               && benchmarks[end].name_.compare(0, operation.size() + 1,
+                                                operation + "/") == 0)
+        {
+            ++end;
+        }
+
+        for (size_t size = 10; size <= maxSize; size *= 10)
+        {
+            for (size_t b = i; b < end; ++b)
+            {
+                std::string name =
+                    benchmarks[b].name_ + "/" + std::to_string(size);
+                if (name.find(filter) == std::string::npos)
+                {
+                    continue;
+                }
+
+                State state(size, minTime);
+                benchmarks[b].run_(state);
+
+                if (csv)
+                {
+                    std::cout << benchmarks[b].name_ << "," << size << ","
+                              << state.iterations() << ","
+                              << state.nsPerIteration() << ","
+                              << state.bytesPerSecond() << std::endl;
+                    continue;
+                }
+                std::cout << std::left << std::setw(44) << name
+                          << std::right << std::fixed << std::setprecision(1)
+                          << std::setw(16) << state.nsPerIteration()
+                          << std::setw(14) << state.iterations();
+                if (state.bytesPerSecond() != 0)
+                {
+                    std::cout << std::setw(14)
+                              << state.bytesPerSecond() / 1e6;
+                }
+                std::cout << std::endl;
+            }
+        }
+        i = end;
+    }
+
+    return 0;
+}
@@ -15,7 +15,7 @@
 #define LOAD_GENERIC_STRING 0       // 0 = Normal, 1 = Load Code Dynamically
 #endif
 
-#define INSERT_ERASE 0             // 0 = Do not test, 1 = do test
+#define INSERT_ERASE 1             // 0 = Do not test, 1 = do test
 
 #if LOAD_GENERIC_STRING
 #else
@@ -23,12 +23,21 @@
 using TestingString = ChunkyString;
 #endif
 
+#include "concurrentchunkystring.hpp"
+
 #include <string>
 #include <sstream>
 #include <stdexcept>
 #include <cstddef>
+#include <cstdio>
 #include <cstdlib>
 #include <cassert>
+#include <new>
+#include <unordered_map>
+#include <algorithm>
+#include <cctype>
+#include <thread>
+#include <atomic>
 
 #include "signal.h"
 #include "unistd.h"
@@ -41,6 +50,25 @@ static const size_t CHUNKSIZE = 12;     // Assuming a chunksize of 12
 //           HELPER FUNCTIONS
 //--------------------------------------------------
 
+/// Number of calls to operator new so far on this thread, for
+/// allocation-count tests. Per thread, so the threaded tests don't race
+/// on it.
+static thread_local size_t allocationCount = 0;
+
+void* operator new(size_t bytes)
+{
+    ++allocationCount;
+    void* p = malloc(bytes);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
 enum randomness_t  { MIN_VALUE, MAX_VALUE, MID_VALUE, RANDOM_VALUE };
 
 /**
@@ -344,9 +372,72 @@ void checkUtilization(const TestingString& test, size_t divisor, string origin)
     divisor = CHUNKSIZE / divisor;
     chunks += (size + divisor - 1) / divisor;
     EXPECT_GT(test.utilization(), double(size) / double(chunks * CHUNKSIZE))
-            << origin;
+            << origin << std::endl << test.stats();
+}
+
+/**
+ * \brief Checks that utilization is as high as the string's size allows,
+ *        i.e., every chunk but the last is full.
+ *
+ * \param test          TestingString to check
+ * \param origin        String to describe the caller of this function to
+ *                      aid in human debugging.
+ */
+void checkCompact(const TestingString& test, string origin)
+{
+    if (test.size() == 0)
+        return;
+
+    size_t chunks = (test.size() + CHUNKSIZE - 1) / CHUNKSIZE;
+    EXPECT_DOUBLE_EQ(double(test.size()) / double(chunks * CHUNKSIZE),
+                     test.utilization()) << origin;
+}
+
+#if INSERT_ERASE
+/**
+ * \brief Builds a string of the given size, then erases about two thirds
+ *        of it at random, leaving chunks partly empty.
+ *
+ * \param test          TestingString to fill; must start empty
+ * \param control       string kept equal to test
+ * \param size          number of characters to start with
+ */
+void fragment(TestingString& test, string& control, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        char c = 'a' + i % 26;
+        test.push_back(c);
+        control.push_back(c);
+    }
+
+    for (size_t i = 0; i < size * 2 / 3; ++i)
+    {
+        size_t index = maybeRandomInt(test.size() - 1, RANDOM_VALUE);
+        TestingString::iterator a = test.begin();
+        std::advance(a, index);
+        test.erase(a);
+        control.erase(index, 1);
+    }
+}
+#endif
+
+/// Builds a TestingString holding the bytes of control, via push_back.
+TestingString chunkyFrom(const string& control)
+{
+    TestingString test;
+    for (size_t i = 0; i < control.size(); ++i)
+    {
+        test.push_back(control[i]);
+    }
+    return test;
 }
 
+/// A mostly non-ASCII UTF-8 string whose sequences straddle chunks.
+static const string UTF8_SAMPLE = "na\xC3\xAFve caf\xC3\xA9 \xE2\x82\xAC"
+                                  "\xF0\x9F\x98\x80\xF0\x9F\x98\x80"
+                                  "\xCE\xB1\xCE\xB2\xCE\xB3\xE2\x82\xAC";
+
 //--------------------------------------------------
 //           TEST FUNCTIONS
 //--------------------------------------------------
@@ -544,6 +635,26 @@ TEST(insert, empty)
 
 }
 
+TEST(insert, repeatedly_at_end)
+{
+    // inserting at end() appends like push_back, filling every chunk
+    // instead of splitting the last one
+    TestingString test;
+    string control;
+    for (size_t i = 0; i < 10 * CHUNKSIZE; ++i)
+    {
+        char c = 'a' + i % 26;
+        TestingString::iterator inserted = test.insert(test.end(), c);
+        control.push_back(c);
+        ASSERT_EQ(control.back(), *inserted);
+        ASSERT_EQ(test.size() - 1, size_t(std::distance(test.begin(), 
+                                                        inserted)));
+    }
+    EXPECT_EQ(10u, test.stats().chunks_);
+    EXPECT_EQ(1.0, test.utilization());
+    checkWithControl(test, control, "repeated insert at end");
+}
+
 TEST(erase, push_one_erase_one)
 {
     TestingString test;
@@ -721,6 +832,2027 @@ TEST(iterator, dereferencing)
     EXPECT_EQ(*a, *b);
 }
 
+TEST(codepoints, count)
+{
+    TestingString test = chunkyFrom(UTF8_SAMPLE);
+
+    // n a i v e _ c a f e _ euro smiley smiley alpha beta gamma euro
+    EXPECT_EQ(18u, test.codepoints());
+
+    TestingString empty;
+    EXPECT_EQ(0u, empty.codepoints());
+}
+
+TEST(codepoints, codepoint_at)
+{
+    const TestingString test = chunkyFrom(UTF8_SAMPLE);
+
+    // walk the control, checking the byte offset of every lead byte
+    size_t n = 0;
+    for (size_t i = 0; i < UTF8_SAMPLE.size(); ++i)
+    {
+        if ((UTF8_SAMPLE[i] & 0xC0) == 0x80)
+        {
+            continue;
+        }
+        TestingString::const_iterator a = test.codepoint_at(n);
+        EXPECT_EQ(ptrdiff_t(i), std::distance(test.begin(), a))
+            << "code point " << n;
+        ++n;
+    }
+    EXPECT_TRUE(test.codepoint_at(n) == test.end());
+}
+
+TEST(codepoints, iterate)
+{
+    TestingString test = chunkyFrom(UTF8_SAMPLE);
+    char32_t expected[] = { 'n', 'a', 0xEF, 'v', 'e', ' ', 'c', 'a', 'f',
+                            0xE9, ' ', 0x20AC, 0x1F600, 0x1F600, 0x3B1,
+                            0x3B2, 0x3B3, 0x20AC };
+
+    size_t n = 0;
+    for (TestingString::codepoint_iterator i = test.begin_codepoints();
+         i != test.end_codepoints(); ++i, ++n)
+    {
+        ASSERT_LT(n, sizeof(expected) / sizeof(expected[0]));
+        EXPECT_EQ(expected[n], *i) << "code point " << n;
+    }
+    EXPECT_EQ(sizeof(expected) / sizeof(expected[0]), n);
+}
+
+TEST(codepoints, write_through_iterator)
+{
+    TestingString test = chunkyFrom(UTF8_SAMPLE);
+    size_t before = test.codepoints();
+
+    // turn the first byte of the smiley into a continuation byte
+    TestingString::iterator a = test.codepoint_at(12);
+    *a = '\x80';
+
+    EXPECT_EQ(before - 1, test.codepoints());
+    EXPECT_FALSE(test.valid_utf8());
+}
+
+TEST(codepoints, kept_current_by_edits)
+{
+    // pieces of UTF8_SAMPLE, so edits cut code points apart
+    string control = UTF8_SAMPLE;
+    TestingString test = chunkyFrom(control);
+    for (size_t step = 0; step < 300; ++step)
+    {
+        size_t pos = maybeRandomInt(control.size(), RANDOM_VALUE);
+        size_t length = std::min<size_t>(control.size() - pos,
+                                         maybeRandomInt(20, RANDOM_VALUE));
+        string text = UTF8_SAMPLE.substr(
+                          maybeRandomInt(UTF8_SAMPLE.size(), RANDOM_VALUE),
+                          maybeRandomInt(20, RANDOM_VALUE));
+
+        TestingString::iterator first = test.begin();
+        std::advance(first, pos);
+        TestingString::iterator last = first;
+        std::advance(last, length);
+        test.replace(first, last, text.data(), text.size());
+        control.replace(pos, length, text);
+        if (step % 50 == 0)
+        {
+            test.compact();
+        }
+
+        size_t expected = 0;
+        for (char c : control)
+        {
+            expected += (static_cast<unsigned char>(c) & 0xC0) != 0x80;
+        }
+        ASSERT_EQ(expected, test.codepoints());
+    }
+}
+
+TEST(valid_utf8, well_formed)
+{
+    EXPECT_TRUE(chunkyFrom(UTF8_SAMPLE).valid_utf8());
+    EXPECT_TRUE(chunkyFrom("plain old ascii, long enough for words").
+                valid_utf8());
+    EXPECT_TRUE(TestingString().valid_utf8());
+}
+
+TEST(valid_utf8, malformed)
+{
+    // truncated at the end, overlong, surrogate, past U+10FFFF, stray byte
+    EXPECT_FALSE(chunkyFrom(UTF8_SAMPLE + "\xE2\x82").valid_utf8());
+    EXPECT_FALSE(chunkyFrom("abcdefghijk\xC0\xAF").valid_utf8());
+    EXPECT_FALSE(chunkyFrom("\xED\xA0\x80").valid_utf8());
+    EXPECT_FALSE(chunkyFrom("\xF4\x90\x80\x80").valid_utf8());
+    EXPECT_FALSE(chunkyFrom("abc\x80").valid_utf8());
+}
+
+TEST(hash, equal_strings)
+{
+    TestingString first = chunkyFrom("hash me across several chunks");
+    TestingString second(first);
+    TestingString third = chunkyFrom("hash me across several chunks");
+
+    EXPECT_EQ(first.hash(), second.hash());
+    EXPECT_EQ(first.hash(), third.hash());
+    EXPECT_EQ(std::hash<TestingString>()(first), first.hash());
+}
+
+TEST(hash, different_strings)
+{
+    // differ only in the last byte, and only in length
+    EXPECT_NE(chunkyFrom("abcdefghijklmnopq").hash(),
+              chunkyFrom("abcdefghijklmnopr").hash());
+    EXPECT_NE(chunkyFrom(string(9, '\0')).hash(),
+              chunkyFrom(string(10, '\0')).hash());
+    EXPECT_NE(TestingString().hash(), chunkyFrom("a").hash());
+}
+
+TEST(hash, unordered_map_key)
+{
+    std::unordered_map<TestingString, int> counts;
+    for (int i = 0; i < 3; ++i)
+    {
+        ++counts[chunkyFrom("apple")];
+        ++counts[chunkyFrom(UTF8_SAMPLE)];
+    }
+    ++counts[chunkyFrom("pear")];
+
+    EXPECT_EQ(3u, counts.size());
+    EXPECT_EQ(3, counts[chunkyFrom("apple")]);
+    EXPECT_EQ(3, counts[chunkyFrom(UTF8_SAMPLE)]);
+    EXPECT_EQ(1, counts[chunkyFrom("pear")]);
+}
+
+TEST(hash, invalidated_by_push_back)
+{
+    TestingString test = chunkyFrom("abcdefghijklm");
+    size_t before = test.hash();
+
+    test.push_back('n');
+    EXPECT_NE(before, test.hash());
+    EXPECT_EQ(chunkyFrom("abcdefghijklmn").hash(), test.hash());
+}
+
+TEST(hash, invalidated_by_iterator_write)
+{
+    TestingString test = chunkyFrom("abcdefghijklm");
+    TestingString copy(test);
+
+    // cache both hashes, then change one string behind their back
+    EXPECT_EQ(test.hash(), copy.hash());
+    EXPECT_TRUE(test == copy);
+    TestingString::iterator a = test.begin();
+    std::advance(a, 12);
+    *a = 'z';
+
+    EXPECT_FALSE(test == copy);
+    EXPECT_EQ(chunkyFrom("abcdefghijklz").hash(), test.hash());
+
+    *a = 'm';
+    EXPECT_TRUE(test == copy);
+}
+
+TEST(hash, write_through_held_reference)
+{
+    TestingString test = chunkyFrom("abcdefghijklm");
+    TestingString copy(test);
+
+    // take the reference before the hashes are cached, write after
+    TestingString::iterator a = test.begin();
+    std::advance(a, 5);
+    TestingString::iterator::reference r = *a;
+    EXPECT_EQ(test.hash(), copy.hash());
+    EXPECT_TRUE(test == copy);
+    r = '!';
+
+    EXPECT_FALSE(test == copy);
+    EXPECT_EQ(chunkyFrom("abcde!ghijklm").hash(), test.hash());
+    r = 'f';
+    EXPECT_TRUE(test == copy);
+
+    // assigning one reference to another copies the character
+    TestingString::iterator b = test.begin();
+    *b = *a;
+    EXPECT_EQ(chunkyFrom("fbcdefghijklm"), test);
+}
+
+TEST(hash, concurrent_readers)
+{
+    TestingString first = chunkyFrom(string(1000, 'a'));
+    TestingString second(first);
+    TestingString third = chunkyFrom(string(999, 'a') + "b");
+    std::unordered_map<TestingString, int> index;
+    index[first] = 1;
+    index[third] = 3;
+    first.push_back('c');    // leaves first's hash uncached
+
+    // every thread fills the same caches; none may disagree
+    std::vector<std::thread> readers;
+    std::atomic<size_t> wrong(0);
+    for (size_t t = 0; t < 4; ++t)
+    {
+        readers.emplace_back([&] {
+            for (size_t round = 0; round < 50; ++round)
+            {
+                wrong += first.hash() == second.hash();
+                wrong += first == second;
+                wrong += !(second == chunkyFrom(string(1000, 'a')));
+                wrong += index.at(third) != 3;
+                wrong += index.at(second) != 1;
+                wrong += index.count(first) != 0;
+            }
+        });
+    }
+    for (std::thread& reader : readers)
+    {
+        reader.join();
+    }
+    EXPECT_EQ(0u, wrong.load());
+}
+
+TEST(small_string, no_allocation)
+{
+    string control;
+    for (size_t i = 0; i < TestingString::INLINE_CHUNKS * CHUNKSIZE; ++i)
+    {
+        control.push_back('a' + i % 26);
+    }
+
+    size_t before = allocationCount;
+    TestingString test;
+    for (size_t i = 0; i < control.size(); ++i)
+    {
+        test.push_back(control[i]);
+    }
+    TestingString copy(test);
+    TestingString assigned;
+    assigned = copy;
+    EXPECT_EQ(before, allocationCount);
+
+    checkWithControl(test, control, "short string stored inline");
+    checkBothIdentical(test, copy, "copy of short string");
+    checkBothIdentical(test, assigned, "assigned short string");
+}
+
+TEST(small_string, spill_to_heap)
+{
+    TestingString test = chunkyFrom(string(TestingString::INLINE_CHUNKS
+                                           * CHUNKSIZE, 'x'));
+    size_t before = allocationCount;
+
+    // one more character needs one more chunk, which must come from the heap
+    test.push_back('y');
+    EXPECT_EQ(before + 1, allocationCount);
+
+    string control(TestingString::INLINE_CHUNKS * CHUNKSIZE, 'x');
+    control.push_back('y');
+    checkWithControl(test, control, "string spilled past the inline chunks");
+
+    // assigning a short string back frees the heap chunk for reuse
+    test = chunkyFrom("short");
+    checkWithControl(test, "short", "reassigned after spilling");
+    test += chunkyFrom(string(30, 'z'));
+    checkWithControl(test, "short" + string(30, 'z'), "grown again");
+}
+
+TEST(capacity, reserve_allocates_once)
+{
+    string control(1000, 'r');
+    TestingString test;
+
+    size_t before = allocationCount;
+    test.reserve(control.size());
+    EXPECT_EQ(before + 1, allocationCount);
+    EXPECT_GE(test.capacity(), control.size());
+
+    before = allocationCount;
+    for (size_t i = 0; i < control.size(); ++i)
+    {
+        test.push_back(control[i]);
+    }
+    EXPECT_EQ(before, allocationCount);
+    checkWithControl(test, control, "pushing back into reserved chunks");
+}
+
+TEST(capacity, reserve_never_shrinks)
+{
+    TestingString test = chunkyFrom(string(100, 'c'));
+    size_t capacity = test.capacity();
+
+    test.reserve(10);
+    EXPECT_EQ(capacity, test.capacity());
+    EXPECT_GE(capacity, test.size());
+}
+
+TEST(capacity, freed_chunks_are_reused)
+{
+    TestingString test = chunkyFrom(string(100, 'f'));
+    TestingString tail = chunkyFrom(string(30, 'g'));
+    test.reserve(test.size());
+    test = chunkyFrom("tiny");
+
+    size_t before = allocationCount;
+    test += tail;
+    for (size_t i = 0; i < 66; ++i)
+    {
+        test.push_back('h');
+    }
+    EXPECT_EQ(before + 1, allocationCount) << "only the copy of tail allocates";
+    checkWithControl(test, "tiny" + string(30, 'g') + string(66, 'h'),
+                     "reusing chunks after shrinking");
+}
+
+TEST(capacity, erase_frees_unreserved_chunks)
+{
+    // without a reservation, erasing gives the chunks back
+    string control(12000, 'e');
+    TestingString test = chunkyFrom(control);
+    TestingString::MemoryUsage full = test.memory_usage();
+
+    TestingString::iterator first = test.begin();
+    std::advance(first, 600);
+    TestingString::iterator last = first;
+    std::advance(last, 10800);
+    test.replace(first, last, "", 0);
+    control.erase(600, 10800);
+    checkWithControl(test, control, "erasing 90%");
+
+    TestingString::MemoryUsage erased = test.memory_usage();
+    EXPECT_LT(erased.totalBytes_, full.totalBytes_ / 5);
+    EXPECT_LE(erased.spareBytes_, 
+              TestingString::INLINE_CHUNKS * full.totalBytes_ / 1000);
+
+    // with one, they are kept for the string to grow back into
+    test.reserve(12000);
+    size_t reserved = test.memory_usage().totalBytes_;
+    for (size_t i = 0; i < 10800; ++i)
+    {
+        test.push_back('e');
+    }
+    for (size_t i = 0; i < 10800; ++i)
+    {
+        test.erase(test.begin());
+    }
+    EXPECT_EQ(reserved, test.memory_usage().totalBytes_);
+    checkWithControl(test, string(1200, 'e'), "growing and erasing again");
+}
+
+TEST(capacity, shrink_to_fit)
+{
+    TestingString empty;
+    empty.reserve(1000);
+    empty.shrink_to_fit();
+    EXPECT_EQ(TestingString::INLINE_CHUNKS * CHUNKSIZE, empty.capacity());
+
+    string control(100, 's');
+    TestingString test = chunkyFrom(control);
+    test.reserve(1000);
+    test.shrink_to_fit();
+    EXPECT_LT(test.capacity(), test.size() + CHUNKSIZE);
+    checkWithControl(test, control, "shrinking after reserve");
+}
+
+TEST(capacity, shrink_many_blocks)
+{
+    // each reserve() adds a two-chunk block, which the text then fills
+    string control;
+    TestingString test;
+    for (size_t i = 0; i < 3000; ++i)
+    {
+        test.reserve(test.capacity() + 2 * CHUNKSIZE);
+        string more(2 * CHUNKSIZE, char('a' + i % 26));
+        for (char c : more)
+        {
+            test.push_back(c);
+        }
+        control += more;
+    }
+
+    // erasing leaves most blocks entirely spare, a few partly in use
+    TestingString::iterator first = test.begin();
+    std::advance(first, 1000);
+    TestingString::iterator last = first;
+    std::advance(last, control.size() - 2000);
+    test.replace(first, last, "", 0);
+    control.erase(1000, control.size() - 2000);
+
+    test.shrink_to_fit();
+    EXPECT_LT(test.capacity(), 2 * test.size() + 2 * CHUNKSIZE);
+    checkWithControl(test, control, "shrinking many blocks");
+}
+
+TEST(memory_usage, empty)
+{
+    TestingString test;
+    TestingString::MemoryUsage usage = test.memory_usage();
+
+    EXPECT_EQ(1u, usage.strings_);
+    EXPECT_EQ(sizeof(TestingString), usage.totalBytes_);
+    EXPECT_EQ(0u, usage.payloadBytes_);
+    EXPECT_EQ(0u, usage.freeCells_);
+    EXPECT_EQ(0u, usage.allocations_);
+    EXPECT_GT(usage.spareBytes_, 0u) << "inline chunks are spare";
+}
+
+TEST(memory_usage, breakdown)
+{
+    TestingString test = chunkyFrom(string(100, 'm'));
+    TestingString::MemoryUsage usage = test.memory_usage();
+    size_t chunks = (100 + CHUNKSIZE - 1) / CHUNKSIZE;
+
+    EXPECT_EQ(100u, usage.payloadBytes_);
+    EXPECT_EQ(chunks * CHUNKSIZE - 100, usage.freeCells_);
+    EXPECT_EQ(chunks - TestingString::INLINE_CHUNKS, usage.allocations_);
+    EXPECT_GT(usage.nodeOverheadBytes_, 0u);
+    EXPECT_GE(usage.totalBytes_, usage.payloadBytes_ + usage.freeCells_
+                                 + usage.nodeOverheadBytes_
+                                 + usage.spareBytes_);
+
+    // one more allocation for a reserved block, which is all spare
+    test.reserve(1000);
+    TestingString::MemoryUsage reserved = test.memory_usage();
+    EXPECT_EQ(usage.allocations_ + 1, reserved.allocations_);
+    EXPECT_GT(reserved.spareBytes_, usage.spareBytes_);
+    EXPECT_GT(reserved.totalBytes_, usage.totalBytes_);
+
+    test.shrink_to_fit();
+    EXPECT_EQ(usage.totalBytes_, test.memory_usage().totalBytes_);
+}
+
+TEST(memory_usage, extras)
+{
+    TestingString test = chunkyFrom(string(100, 'e'));
+    TestingString::MemoryUsage plain = test.memory_usage();
+    EXPECT_EQ(0u, plain.extrasBytes_);
+
+    // overwriting in place leaves the chunks as they were
+    test.enable_journal();
+    TestingString::iterator first = std::next(test.begin(), 10);
+    test.replace(first, std::next(first, 40), string(40, 'E').data(), 40);
+    TestingString::Mark mark(test, std::next(test.begin(), 50));
+    TestingString::Snapshot snapshot = test.snapshot();
+
+    TestingString::MemoryUsage extras = test.memory_usage();
+    EXPECT_GT(extras.extrasBytes_, test.journal_bytes() + 100);
+    EXPECT_EQ(plain.totalBytes_ + extras.extrasBytes_, extras.totalBytes_);
+    EXPECT_GE(extras.allocations_, plain.allocations_ + 5);
+
+    // dropping the snapshot and the journal gives most of it back
+    snapshot = TestingString::Snapshot();
+    test.disable_journal();
+    TestingString::MemoryUsage fewer = test.memory_usage();
+    EXPECT_LT(fewer.extrasBytes_ + 100, extras.extrasBytes_);
+    EXPECT_GT(fewer.extrasBytes_, 0u);
+}
+
+TEST(memory_usage, total)
+{
+    TestingString::MemoryUsage before = TestingString::total_memory_usage();
+    {
+        TestingString first = chunkyFrom(string(50, 'a'));
+        TestingString second(first);
+        TestingString::MemoryUsage during = 
+            TestingString::total_memory_usage();
+
+        EXPECT_EQ(before.strings_ + 2, during.strings_);
+        EXPECT_EQ(before.payloadBytes_ + 100, during.payloadBytes_);
+        EXPECT_EQ(before.totalBytes_ + first.memory_usage().totalBytes_
+                                     + second.memory_usage().totalBytes_,
+                  during.totalBytes_);
+    }
+    TestingString::MemoryUsage after = TestingString::total_memory_usage();
+    EXPECT_EQ(before.strings_, after.strings_);
+    EXPECT_EQ(before.totalBytes_, after.totalBytes_);
+}
+
+TEST(memory_usage, total_across_threads)
+{
+    TestingString::MemoryUsage before = TestingString::total_memory_usage();
+
+    // strings made on several threads, destroyed on this one
+    std::vector<std::unique_ptr<TestingString>> made(8);
+    std::vector<std::thread> makers;
+    for (size_t t = 0; t < made.size(); ++t)
+    {
+        makers.emplace_back([&made, t] {
+            for (size_t i = 0; i < 100; ++i)
+            {
+                TestingString temporary = chunkyFrom(string(30, 't'));
+            }
+            made[t].reset(new TestingString(chunkyFrom(string(t, 'm'))));
+        });
+    }
+    for (std::thread& maker : makers)
+    {
+        maker.join();
+    }
+
+    TestingString::MemoryUsage during = TestingString::total_memory_usage();
+    EXPECT_EQ(before.strings_ + made.size(), during.strings_);
+    EXPECT_EQ(before.payloadBytes_ + 28, during.payloadBytes_);
+
+    made.clear();
+    TestingString::MemoryUsage after = TestingString::total_memory_usage();
+    EXPECT_EQ(before.strings_, after.strings_);
+    EXPECT_EQ(before.totalBytes_, after.totalBytes_);
+}
+
+TEST(compact, already_compact)
+{
+    string control(100, 'k');
+    TestingString test = chunkyFrom(control);
+
+    test.compact();
+    checkWithControl(test, control, "compacting a compact string");
+    checkCompact(test, "compacting a compact string");
+
+    size_t steps = 1;
+    while (!test.compact_step(1))
+    {
+        ++steps;
+    }
+    EXPECT_EQ((control.size() + CHUNKSIZE - 1) / CHUNKSIZE, steps);
+    checkWithControl(test, control, "stepping over a compact string");
+
+    TestingString empty;
+    empty.compact();
+    EXPECT_TRUE(empty.compact_step(1));
+}
+
+#if INSERT_ERASE
+TEST(compact, after_erase)
+{
+    TestingString test;
+    string control;
+    fragment(test, control, 600);
+
+    test.compact();
+    checkWithControl(test, control, "compacting after erase");
+    checkCompact(test, "compacting after erase");
+}
+
+TEST(compact, incremental)
+{
+    TestingString test;
+    string control;
+    fragment(test, control, 600);
+
+    // small budgets, interleaved with appends
+    size_t calls = 0;
+    while (!test.compact_step(3))
+    {
+        ++calls;
+        test.push_back('!');
+        control.push_back('!');
+    }
+    EXPECT_GT(calls, 0u);
+    checkWithControl(test, control, "compacting incrementally");
+
+    test.compact();
+    checkCompact(test, "compacting incrementally");
+}
+#endif
+
+#if INSERT_ERASE
+/**
+ * \brief Builds a string of 50 full chunks, then erases 5 characters out
+ *        of every chunk, back to front.
+ *
+ * \param test          TestingString to fill; must start empty
+ * \param control       string kept equal to test
+ */
+void thinEveryChunk(TestingString& test, string& control)
+{
+    for (size_t i = 0; i < 50 * CHUNKSIZE; ++i)
+    {
+        char c = 'A' + i % 26;
+        test.push_back(c);
+        control.push_back(c);
+    }
+
+    for (size_t chunk = 50; chunk > 0; --chunk)
+    {
+        size_t index = (chunk - 1) * CHUNKSIZE + 7;
+        TestingString::iterator a = test.begin();
+        std::advance(a, index);
+        for (size_t k = 0; k < 5; ++k)
+        {
+            a = test.erase(a);
+        }
+        control.erase(index, 5);
+    }
+}
+
+TEST(reflow_policy, default_and_set)
+{
+    TestingString test;
+    EXPECT_DOUBLE_EQ(0.5, test.reflow_policy().target_);
+    EXPECT_EQ(2u, test.reflow_policy().chunksPerEdit_);
+
+    TestingString::ReflowPolicy eager = { 0.9, 4 };
+    test.set_reflow_policy(eager);
+    EXPECT_DOUBLE_EQ(0.9, test.reflow_policy().target_);
+    EXPECT_EQ(4u, test.reflow_policy().chunksPerEdit_);
+}
+
+TEST(reflow_policy, disabled)
+{
+    TestingString test;
+    string control;
+    TestingString::ReflowPolicy off = { 0.0, 0 };
+    test.set_reflow_policy(off);
+
+    // neighbors with 7 characters each can't be merged locally
+    thinEveryChunk(test, control);
+    checkWithControl(test, control, "thinning without repacking");
+    EXPECT_DOUBLE_EQ(7.0 / CHUNKSIZE, test.utilization());
+    EXPECT_EQ(50u, test.stats().lengths_[7]);
+}
+
+TEST(reflow_policy, repacks_while_editing)
+{
+    TestingString test;
+    string control;
+    TestingString::ReflowPolicy eager = { 0.9, 4 };
+    test.set_reflow_policy(eager);
+
+    thinEveryChunk(test, control);
+    checkWithControl(test, control, "thinning while repacking");
+    EXPECT_GT(test.utilization(), 0.85);
+}
+#endif
+
+TEST(stats, empty)
+{
+    TestingString test;
+    TestingString::ChunkStats stats = test.stats();
+
+    EXPECT_EQ(0u, stats.chunks_);
+    EXPECT_EQ(0u, stats.underfilled_);
+    EXPECT_EQ(0u, stats.underfilledRuns_);
+    EXPECT_EQ(0u, stats.longestUnderfilledRun_);
+}
+
+TEST(stats, push_back)
+{
+    TestingString test = chunkyFrom(string(8 * CHUNKSIZE + 4, 'x'));
+    TestingString::ChunkStats stats = test.stats();
+
+    EXPECT_EQ(9u, stats.chunks_);
+    EXPECT_EQ(8u, stats.lengths_[CHUNKSIZE]);
+    EXPECT_EQ(1u, stats.lengths_[4]);
+    EXPECT_EQ(1u, stats.underfilled_);
+    EXPECT_EQ(1u, stats.underfilledRuns_);
+    EXPECT_EQ(1u, stats.longestUnderfilledRun_);
+}
+
+#if INSERT_ERASE
+TEST(stats, no_underfilled_runs_after_erase)
+{
+    TestingString test;
+    string control;
+    TestingString::ReflowPolicy off = { 0.0, 0 };
+    test.set_reflow_policy(off);
+    fragment(test, control, 600);
+
+    // local merging alone must keep under-filled chunks apart
+    TestingString::ChunkStats stats = test.stats();
+    size_t chunks = 0;
+    size_t chars = 0;
+    for (size_t n = 0; n <= CHUNKSIZE; ++n)
+    {
+        chunks += stats.lengths_[n];
+        chars += n * stats.lengths_[n];
+    }
+    EXPECT_EQ(stats.chunks_, chunks);
+    EXPECT_EQ(test.size(), chars);
+    EXPECT_EQ(0u, stats.lengths_[0]);
+    EXPECT_EQ(stats.underfilled_, stats.underfilledRuns_) << stats;
+    EXPECT_GE(1u, stats.longestUnderfilledRun_) << stats;
+}
+#endif
+
+TEST(iterator, no_allocations)
+{
+    string control(50 * CHUNKSIZE + 5, 'q');
+    TestingString test = chunkyFrom(control);
+    const TestingString& constTest = test;
+
+    size_t before = allocationCount;
+    size_t count = 0;
+    for (TestingString::iterator i = test.begin(); i != test.end(); ++i)
+    {
+        count += (*i == 'q');
+    }
+    for (TestingString::const_iterator i = constTest.begin();
+         i != constTest.end(); ++i)
+    {
+        count += (*i == 'q');
+    }
+    TestingString::const_iterator i = constTest.end();
+    while (i != constTest.begin())
+    {
+        --i;
+        count += (*i == 'q');
+    }
+    EXPECT_EQ(before, allocationCount);
+    EXPECT_EQ(3 * control.size(), count);
+}
+
+TEST(iterator, sees_push_back)
+{
+    // an iterator into the last chunk walks onto characters pushed after
+    // it was made
+    TestingString test = chunkyFrom("ab");
+    TestingString::iterator i = test.begin();
+    test.push_back('c');
+    test.push_back('d');
+
+    string seen;
+    for ( ; i != test.end(); ++i)
+    {
+        seen.push_back(*i);
+    }
+    EXPECT_EQ("abcd", seen);
+}
+
+TEST(iterator, const_and_mutable_agree)
+{
+    TestingString test = chunkyFrom(UTF8_SAMPLE);
+    TestingString::iterator i = test.begin();
+    TestingString::const_iterator c = i;
+    for ( ; i != test.end(); ++i, ++c)
+    {
+        ASSERT_TRUE(c == TestingString::const_iterator(i));
+        EXPECT_EQ(*c, *i);
+    }
+    EXPECT_TRUE(c == test.end());
+}
+
+TEST(iterator, swapping_algorithms)
+{
+    string control = "abcdefghijklm" + UTF8_SAMPLE + "nopqrstuvwxyz";
+    TestingString test = chunkyFrom(control);
+    test.hash();
+
+    // the references are proxies, so these swap through swap() above
+    std::reverse(test.begin(), test.end());
+    std::reverse(control.begin(), control.end());
+    checkWithControl(test, control, "std::reverse");
+    EXPECT_EQ(chunkyFrom(control).hash(), test.hash());
+    EXPECT_EQ(chunkyFrom(control).codepoints(), test.codepoints());
+
+    // swap the (ASCII) first and last ten characters
+    size_t tail = control.size() - 10;
+    TestingString::iterator last10 = test.begin();
+    std::advance(last10, tail);
+    TestingString::iterator first10 = test.begin();
+    std::advance(first10, 10);
+    std::swap_ranges(test.begin(), first10, last10);
+    std::swap_ranges(control.begin(), control.begin() + 10,
+                     control.begin() + tail);
+    checkWithControl(test, control, "std::swap_ranges");
+
+    std::iter_swap(test.begin(), last10);
+    std::iter_swap(control.begin(), control.begin() + tail);
+    checkWithControl(test, control, "std::iter_swap");
+
+    std::replace(test.begin(), test.end(), 'q', '?');
+    std::replace(control.begin(), control.end(), 'q', '?');
+    checkWithControl(test, control, "std::replace");
+    EXPECT_EQ(chunkyFrom(control).hash(), test.hash());
+    EXPECT_EQ(chunkyFrom(control).codepoints(), test.codepoints());
+
+    // swapping a character with itself leaves it alone
+    using std::swap;
+    swap(*last10, *last10);
+    checkWithControl(test, control, "self-swap");
+}
+
+#if INSERT_ERASE
+TEST(replace, same_length_overwrites)
+{
+    string control(5 * CHUNKSIZE, 'a');
+    TestingString test = chunkyFrom(control);
+    double utilization = test.utilization();
+
+    TestingString::iterator first = test.begin();
+    std::advance(first, 7);
+    TestingString::iterator last = first;
+    std::advance(last, 20);
+    string text(20, 'z');
+    TestingString::iterator after = test.replace(first, last, text.data(),
+                                                 text.size());
+    control.replace(7, 20, text);
+
+    checkWithControl(test, control, "replacing in place");
+    EXPECT_DOUBLE_EQ(utilization, test.utilization());
+    EXPECT_EQ(control.size() - 27, size_t(std::distance(after, test.end())));
+}
+
+TEST(replace, grow_and_shrink)
+{
+    string control = "the quick brown fox jumps over the lazy dog";
+    TestingString test = chunkyFrom(control);
+
+    // shrink a span crossing chunks
+    TestingString::iterator first = test.begin();
+    std::advance(first, 4);
+    TestingString::iterator last = first;
+    std::advance(last, 15);
+    test.replace(first, last, "slow", 4);
+    control.replace(4, 15, "slow");
+    checkWithControl(test, control, "replacing with something shorter");
+
+    // grow by several chunks in the middle
+    string big(5 * CHUNKSIZE + 3, '#');
+    first = test.begin();
+    std::advance(first, 6);
+    last = first;
+    std::advance(last, 2);
+    TestingString::iterator after = 
+        test.replace(first, last, big.data(), big.size());
+    control.replace(6, 2, big);
+    checkWithControl(test, control, "replacing with something longer");
+    EXPECT_EQ(' ', *after);
+
+    // pure insertion at both ends, and deleting everything
+    test.replace(test.begin(), test.begin(), "<<", 2);
+    test.replace(test.end(), test.end(), ">>", 2);
+    control = "<<" + control + ">>";
+    checkWithControl(test, control, "inserting at both ends");
+    EXPECT_GT(test.utilization(), 0.5);
+
+    after = test.replace(test.begin(), test.end(), "", 0);
+    checkWithControl(test, "", "replacing everything with nothing");
+    EXPECT_TRUE(after == test.end());
+}
+
+TEST(replace, random_against_string)
+{
+    string control;
+    TestingString test;
+    for (size_t step = 0; step < 300; ++step)
+    {
+        size_t pos = maybeRandomInt(control.size(), RANDOM_VALUE);
+        size_t length = std::min<size_t>(control.size() - pos,
+                                         maybeRandomInt(30, RANDOM_VALUE));
+        string text(maybeRandomInt(30, RANDOM_VALUE), randomChar());
+
+        TestingString::iterator first = test.begin();
+        std::advance(first, pos);
+        TestingString::iterator last = first;
+        std::advance(last, length);
+        TestingString::iterator after =
+            test.replace(first, last, text.data(), text.size());
+        control.replace(pos, length, text);
+
+        ASSERT_EQ(control.size() - pos - text.size(),
+                  size_t(std::distance(after, test.end())));
+    }
+    checkWithControl(test, control, "random replacements");
+    checkUtilization(test, 4, "random replacements");
+}
+#endif
+
+TEST(replace_all, basics)
+{
+    TestingString test = chunkyFrom("one fish two fish red fish blue fish");
+    EXPECT_EQ(4u, test.replace_all("fish", "cat"));
+    checkWithControl(test, "one cat two cat red cat blue cat",
+                     "replacing fish with cat");
+    checkCompact(test, "replacing fish with cat");
+
+    TestingString overlapping = chunkyFrom("aaaaa");
+    EXPECT_EQ(2u, overlapping.replace_all("aa", "b"));
+    checkWithControl(overlapping, "bba", "non-overlapping matches");
+
+    TestingString partial = chunkyFrom("abababac abab");
+    EXPECT_EQ(1u, partial.replace_all("ababac", "X"));
+    checkWithControl(partial, "abX abab", "matches after partial matches");
+    EXPECT_EQ(0u, partial.replace_all("ababac", "X"));
+
+    EXPECT_THROW(partial.replace_all("", "X"), std::invalid_argument);
+}
+
+TEST(replace_all, across_chunks)
+{
+    string control;
+    for (size_t i = 0; i < 40; ++i)
+    {
+        control += "<tag attr=\"" + std::to_string(i) + "\"/>";
+    }
+    TestingString test = chunkyFrom(control);
+
+    EXPECT_EQ(40u, test.replace_all("attr", "attribute"));
+    string expected;
+    for (size_t i = 0; i < 40; ++i)
+    {
+        expected += "<tag attribute=\"" + std::to_string(i) + "\"/>";
+    }
+    checkWithControl(test, expected, "replacing across chunks");
+    checkCompact(test, "replacing across chunks");
+
+    EXPECT_EQ(40u, test.replace_all("\"/>", ""));
+    EXPECT_EQ(0u, test.replace_all("\"/>", ""));
+}
+
+TEST(replace_all, no_match_leaves_chunks_alone)
+{
+    string control(1000, 'x');
+    TestingString test = chunkyFrom(control);
+    TestingString::MemoryUsage before = test.memory_usage();
+
+    EXPECT_EQ(0u, test.replace_all("needle", "pin"));
+    TestingString::MemoryUsage after = test.memory_usage();
+    EXPECT_EQ(before.totalBytes_, after.totalBytes_);
+    EXPECT_EQ(before.spareBytes_, after.spareBytes_);
+    EXPECT_EQ(before.allocations_, after.allocations_);
+    checkWithControl(test, control, "replacing what isn't there");
+
+    // a late match keeps the chunks before it, and the marks on them
+    control += "needle" + string(30, 'x');
+    test = chunkyFrom(control);
+    test.enable_journal();
+    TestingString::iterator early = test.begin();
+    std::advance(early, 10);
+    TestingString::Mark mark(test, early);
+    TestingString::Mark late(test, std::next(early, 1020));
+    const char* first = &*TestingString::const_iterator(test.begin());
+
+    EXPECT_EQ(1u, test.replace_all("needle", "pin"));
+    control.replace(1000, 6, "pin");
+    checkWithControl(test, control, "replacing a late match");
+    EXPECT_EQ(first, &*TestingString::const_iterator(test.begin()));
+    EXPECT_EQ(10u, mark.offset());
+    EXPECT_EQ(1027u, late.offset());
+
+    test.undo();
+    checkWithControl(test, string(1000, 'x') + "needle" + string(30, 'x'),
+                     "undoing a late match");
+}
+
+TEST(edit_batch, applies_like_a_patch)
+{
+    string control = "The quick brown fox jumps over the lazy dog.";
+    TestingString test = chunkyFrom(control);
+
+    // offsets are all relative to the original string
+    TestingString::EditBatch batch;
+    batch.insert(0, ">> ");
+    batch.replace(4, 5, "slow");
+    batch.erase(16, 4);
+    batch.insert(31, "all ");
+    batch.insert(31, "of ");
+    batch.replace(35, 9, "sleeping cat!");
+    EXPECT_EQ(6u, batch.size());
+
+    test.apply(batch);
+    checkWithControl(test, 
+                     ">> The slow brown jumps over all of the sleeping cat!",
+                     "applying a batch");
+
+    batch.clear();
+    EXPECT_TRUE(batch.empty());
+    test.apply(batch);
+    EXPECT_EQ(53u, test.size());
+}
+
+TEST(edit_batch, many_hunks)
+{
+    string control;
+    for (size_t i = 0; i < 200 * CHUNKSIZE; ++i)
+    {
+        control.push_back('a' + i % 26);
+    }
+    TestingString test = chunkyFrom(control);
+
+    // every 100 characters, swap a word and drop a few characters; apply
+    // to the control back to front so the offsets stay put
+    TestingString::EditBatch batch;
+    for (size_t offset = 0; offset + 50 < control.size(); offset += 100)
+    {
+        batch.replace(offset + 10, 3, "<hunk>");
+        batch.erase(offset + 40, 7);
+    }
+    for (size_t offset = control.size() / 100 * 100; ; offset -= 100)
+    {
+        if (offset + 50 < control.size())
+        {
+            control.erase(offset + 40, 7);
+            control.replace(offset + 10, 3, "<hunk>");
+        }
+        if (offset == 0)
+        {
+            break;
+        }
+    }
+    
+    test.apply(batch);
+    checkWithControl(test, control, "applying many hunks");
+    EXPECT_EQ(0u, test.stats().lengths_[0]);
+    EXPECT_GT(test.utilization(), 0.5);
+}
+
+TEST(edit_batch, rejects_bad_batches)
+{
+    string control = "unchanged";
+    TestingString test = chunkyFrom(control);
+
+    TestingString::EditBatch unsorted;
+    unsorted.insert(5, "x");
+    unsorted.insert(2, "y");
+    EXPECT_THROW(test.apply(unsorted), std::invalid_argument);
+
+    TestingString::EditBatch overlapping;
+    overlapping.erase(1, 4);
+    overlapping.replace(3, 1, "z");
+    EXPECT_THROW(test.apply(overlapping), std::invalid_argument);
+
+    TestingString::EditBatch pastEnd;
+    pastEnd.erase(5, 5);
+    EXPECT_THROW(test.apply(pastEnd), std::invalid_argument);
+
+    checkWithControl(test, control, "rejected batches");
+}
+
+#if INSERT_ERASE
+TEST(mark, follows_character)
+{
+    string control = "hello, world";
+    TestingString test = chunkyFrom(control);
+    TestingString::iterator w = test.begin();
+    std::advance(w, 7);
+    TestingString::Mark mark(test, w);
+    TestingString::Mark atEnd(test, test.end());
+
+    // inserting in front of the mark, enough to split its chunk
+    for (size_t i = 0; i < 3 * CHUNKSIZE; ++i)
+    {
+        test.insert(test.begin(), 'x');
+    }
+    EXPECT_EQ(7 + 3 * CHUNKSIZE, mark.offset());
+    EXPECT_EQ('w', *mark.position());
+
+    // erasing in front of it, enough to merge chunks
+    for (size_t i = 0; i < 3 * CHUNKSIZE; ++i)
+    {
+        test.erase(test.begin());
+    }
+    test.compact();
+    EXPECT_EQ(7u, mark.offset());
+    EXPECT_EQ('w', *mark.position());
+
+    // erasing the character moves the mark to the one after it
+    test.erase(mark.position());
+    EXPECT_EQ('o', *mark.position());
+
+    test.push_back('!');
+    EXPECT_TRUE(atEnd.position() == test.end());
+    EXPECT_EQ(test.size(), atEnd.offset());
+}
+
+TEST(mark, copies_and_detaching)
+{
+    TestingString::Mark detached;
+    EXPECT_FALSE(detached.attached());
+    {
+        TestingString test = chunkyFrom("abcdef");
+        TestingString::Mark mark(test, test.begin());
+        TestingString::Mark copy = mark;
+        copy.move_to(std::next(test.begin(), 3));
+        EXPECT_EQ(0u, mark.offset());
+        EXPECT_EQ(3u, copy.offset());
+
+        detached = copy;
+        EXPECT_TRUE(detached.attached());
+
+        // copying a string leaves its marks behind
+        TestingString other = test;
+        other.erase(other.begin());
+        EXPECT_EQ(3u, detached.offset());
+
+        // assigning keeps offsets that still fit
+        test = chunkyFrom("xy");
+        EXPECT_EQ(0u, mark.offset());
+        EXPECT_EQ(2u, copy.offset());
+        EXPECT_TRUE(copy.position() == test.end());
+    }
+    EXPECT_FALSE(detached.attached());
+}
+
+TEST(mark, bulk_edits)
+{
+    string control = "one two three two one";
+    TestingString test = chunkyFrom(control);
+    TestingString::Mark three(test, std::next(test.begin(), 8));
+    TestingString::Mark inTwo(test, std::next(test.begin(), 5));
+
+    // a mark on a replaced character moves past the replacement
+    EXPECT_EQ(2u, test.replace_all("two", "2"));
+    EXPECT_EQ(6u, three.offset());
+    EXPECT_EQ(5u, inTwo.offset());
+
+    TestingString::EditBatch batch;
+    batch.insert(0, ">> ");
+    batch.erase(4, 2);
+    test.apply(batch);
+    EXPECT_EQ('t', *three.position());
+    EXPECT_EQ(7u, three.offset());
+    EXPECT_EQ(7u, inTwo.offset());
+
+    TestingString::iterator first = std::next(test.begin(), 3);
+    test.replace(first, std::next(first, 4), "1", 1);
+    EXPECT_EQ(4u, three.offset());
+    checkWithControl(test, ">> 1three 2 one", "bulk edits");
+}
+
+TEST(mark, random_against_offsets)
+{
+    string control;
+    TestingString test;
+    for (size_t i = 0; i < 20 * CHUNKSIZE; ++i)
+    {
+        char c = randomChar();
+        control.push_back(c);
+        test.push_back(c);
+    }
+
+    // the character each mark sits on never changes until it's erased
+    std::vector<TestingString::Mark> marks;
+    std::vector<size_t> offsets;
+    for (size_t i = 0; i < control.size(); i += 7)
+    {
+        marks.push_back(TestingString::Mark(test, std::next(test.begin(), i)));
+        offsets.push_back(i);
+    }
+    for (size_t step = 0; step < 1000; ++step)
+    {
+        size_t offset = maybeRandomInt(control.size() - 1, RANDOM_VALUE);
+        TestingString::iterator i = std::next(test.begin(), offset);
+        if (step % 2 == 0)
+        {
+            test.insert(i, 'a');
+            control.insert(offset, 1, 'a');
+            for (size_t& o : offsets)
+            {
+                o += o >= offset;
+            }
+        }
+        else
+        {
+            test.erase(i);
+            control.erase(offset, 1);
+            for (size_t& o : offsets)
+            {
+                o -= o > offset;
+            }
+        }
+    }
+    checkWithControl(test, control, "marked string");
+    for (size_t i = 0; i < marks.size(); ++i)
+    {
+        EXPECT_EQ(offsets[i], marks[i].offset());
+    }
+}
+#endif
+
+#if INSERT_ERASE
+TEST(journal, typing_coalesces)
+{
+    TestingString test = chunkyFrom("hello world");
+    EXPECT_FALSE(test.journaling());
+    EXPECT_FALSE(test.undo());
+    test.enable_journal();
+
+    // type "brave " with a typo, then backspace over " world"
+    TestingString::iterator i = std::next(test.begin(), 6);
+    for (char c : string("bravx"))
+    {
+        i = std::next(test.insert(i, c));
+    }
+    i = test.erase(std::prev(i));
+    i = std::next(test.insert(i, 'e'));
+    i = std::next(test.insert(i, ' '));
+    test.end_undo_step();
+    for (size_t n = 0; n < 6; ++n)
+    {
+        test.erase(std::prev(test.end()));
+    }
+    checkWithControl(test, "hello brave", "after editing");
+
+    EXPECT_TRUE(test.undo());
+    checkWithControl(test, "hello brave world", "undoing backspaces");
+    EXPECT_TRUE(test.undo());
+    checkWithControl(test, "hello world", "undoing typing");
+    EXPECT_FALSE(test.can_undo());
+
+    EXPECT_TRUE(test.redo());
+    EXPECT_TRUE(test.redo());
+    checkWithControl(test, "hello brave", "redoing both");
+    EXPECT_FALSE(test.redo());
+}
+
+TEST(journal, bulk_edits_undo_whole)
+{
+    string control = "one two three two one";
+    TestingString test = chunkyFrom(control);
+    test.enable_journal();
+
+    TestingString::EditBatch batch;
+    batch.replace(0, 3, "1");
+    batch.erase(8, 6);
+    batch.insert(21, "!");
+    test.apply(batch);
+    EXPECT_EQ(2u, test.replace_all("two", "2"));
+    TestingString::iterator first = test.begin();
+    test.replace(first, std::next(first, 2), "ONE ", 4);
+    checkWithControl(test, "ONE 2 2 one!", "after edits");
+
+    test.undo();
+    checkWithControl(test, "1 2 2 one!", "undoing replace");
+    test.undo();
+    checkWithControl(test, "1 two two one!", "undoing replace_all");
+    test.undo();
+    checkWithControl(test, control, "undoing apply");
+
+    // a new edit forgets what could be redone
+    test.redo();
+    test.push_back('?');
+    EXPECT_FALSE(test.can_redo());
+    checkWithControl(test, "1 two two one!?", "new edit after undo");
+}
+
+TEST(journal, memory_follows_edits)
+{
+    TestingString test;
+    for (size_t i = 0; i < 1000 * CHUNKSIZE; ++i)
+    {
+        test.push_back(randomChar());
+    }
+    test.enable_journal();
+    EXPECT_EQ(0u, test.journal_bytes());
+
+    // a long run of typing is one entry
+    TestingString::iterator i = std::next(test.begin(), 500 * CHUNKSIZE);
+    for (size_t n = 0; n < 100; ++n)
+    {
+        i = std::next(test.insert(i, 'x'));
+    }
+    EXPECT_LT(test.journal_bytes(), 1000u);
+
+    EXPECT_TRUE(test.undo());
+    EXPECT_EQ(1000 * CHUNKSIZE, test.size());
+
+    test.disable_journal();
+    EXPECT_FALSE(test.can_redo());
+    EXPECT_EQ(0u, test.journal_bytes());
+}
+#endif
+
+TEST(snapshot, frozen_and_shared)
+{
+    TestingString::Snapshot none;
+    EXPECT_TRUE(none.empty());
+    EXPECT_EQ(none.begin(), none.end());
+
+    string control = "a snapshot of a chunky string";
+    TestingString test = chunkyFrom(control);
+    TestingString::Snapshot first = test.snapshot();
+    EXPECT_EQ(control, string(first.begin(), first.end()));
+    EXPECT_EQ('s', first[2]);
+
+    // unchanged strings hand out the same buffer
+    TestingString::Snapshot again = test.snapshot();
+    EXPECT_EQ(first.data(), again.data());
+
+    // any change, even through an iterator, makes a new one
+    *test.begin() = 'A';
+    TestingString::Snapshot changed = test.snapshot();
+    EXPECT_NE(first.data(), changed.data());
+    EXPECT_EQ('A', changed[0]);
+    EXPECT_EQ(control, string(first.begin(), first.end()));
+
+    test.push_back('!');
+    test.hash();
+    EXPECT_EQ(control.size() + 1, test.snapshot().size());
+}
+
+#if INSERT_ERASE
+TEST(snapshot, read_while_writing)
+{
+    TestingString test;
+    for (size_t i = 0; i < 100 * CHUNKSIZE; ++i)
+    {
+        test.push_back('a' + i % 26);
+    }
+
+    // the snapshot is taken on the writing thread, as it must be, then
+    // checked on another while the string is being emptied
+    TestingString::Snapshot view = test.snapshot();
+    size_t mismatches = 0;
+    std::thread reader([&view, &mismatches]() {
+        for (size_t pass = 0; pass < 100; ++pass)
+        {
+            for (size_t i = 0; i < view.size(); ++i)
+            {
+                mismatches += view[i] != char('a' + i % 26);
+            }
+        }
+    });
+    while (test.size() > 0)
+    {
+        test.erase(test.begin());
+    }
+    reader.join();
+
+    EXPECT_EQ(0u, mismatches);
+    EXPECT_EQ(100 * CHUNKSIZE, view.size());
+    EXPECT_TRUE(test.snapshot().empty());
+}
+#endif
+
+TEST(parallel, equal_and_compare)
+{
+    // big enough for four threads, with chunks laid out differently
+    size_t size = 4 * TestingString::PARALLEL_GRAIN + 5;
+    string control;
+    for (size_t i = 0; i < size; ++i)
+    {
+        control.push_back('a' + i % 26);
+    }
+    TestingString test = chunkyFrom(control);
+    TestingString other;
+#if INSERT_ERASE
+    for (size_t i = size; i > 0; --i)
+    {
+        other.insert(other.begin(), control[i - 1]);
+    }
+#else
+    other = test;
+#endif
+    EXPECT_TRUE(test.parallel_equal(other, 4));
+    EXPECT_EQ(0, test.parallel_compare(other, 4));
+    EXPECT_TRUE(test.parallel_equal(other, 1));
+
+    // a difference near the end, then one in an earlier part as well
+    *std::next(other.begin(), size - 3) = '~';
+    EXPECT_FALSE(test.parallel_equal(other, 4));
+    EXPECT_GT(0, test.parallel_compare(other, 4));
+    *std::next(other.begin(), 10) = 'A';
+    EXPECT_LT(0, test.parallel_compare(other, 4));
+    EXPECT_EQ(other < test, test.parallel_compare(other, 0) > 0);
+
+    // a proper prefix comes first
+    TestingString prefix = chunkyFrom(control.substr(0, size - 1));
+    EXPECT_FALSE(prefix.parallel_equal(test, 4));
+    EXPECT_GT(0, prefix.parallel_compare(test, 4));
+    EXPECT_LT(0, test.parallel_compare(prefix, 4));
+}
+
+TEST(parallel, small_strings)
+{
+    TestingString empty;
+    TestingString test = chunkyFrom("small");
+    EXPECT_TRUE(empty.parallel_equal(TestingString()));
+    EXPECT_EQ(0, empty.parallel_compare(TestingString(), 8));
+    EXPECT_FALSE(test.parallel_equal(chunkyFrom("smalL"), 8));
+    EXPECT_LT(0, test.parallel_compare(chunkyFrom("smalL"), 8));
+    EXPECT_GT(0, empty.parallel_compare(test));
+}
+
+TEST(find, against_string)
+{
+    // few distinct letters, so patterns match often and partly
+    string control;
+    for (size_t i = 0; i < 30 * CHUNKSIZE; ++i)
+    {
+        control.push_back('a' + maybeRandomInt(2, RANDOM_VALUE));
+    }
+    TestingString test = chunkyFrom(control);
+
+    for (size_t trial = 0; trial < 200; ++trial)
+    {
+        string pattern;
+        size_t length = 1 + maybeRandomInt(4, RANDOM_VALUE);
+        for (size_t i = 0; i < length; ++i)
+        {
+            pattern.push_back('a' + maybeRandomInt(2, RANDOM_VALUE));
+        }
+        size_t from = maybeRandomInt(control.size(), RANDOM_VALUE);
+
+        size_t expected = 0;
+        for (size_t at = control.find(pattern); at != string::npos;
+             at = control.find(pattern, at + 1))
+        {
+            ++expected;
+        }
+        size_t found = control.find(pattern, from);
+        EXPECT_EQ(found == string::npos ? TestingString::npos : found,
+                  test.find(pattern, from));
+        EXPECT_EQ(expected, test.count(pattern));
+    }
+
+    EXPECT_EQ(7u, test.find("", 7));
+    EXPECT_EQ(TestingString::npos, test.find("a", control.size() + 1));
+    EXPECT_EQ(TestingString::npos, test.find(control + "a"));
+    EXPECT_EQ(3u, chunkyFrom("aaaa").count("aa"));
+    EXPECT_THROW(test.count(""), std::invalid_argument);
+}
+
+TEST(find, parallel_straddling_cuts)
+{
+    // with four threads the cuts fall at multiples of a quarter of the
+    // match starts; put matches across each of them
+    string pattern = "needle";
+    size_t size = 4 * TestingString::PARALLEL_GRAIN + pattern.size();
+    string control(size, '.');
+    size_t starts = size - pattern.size() + 1;
+    for (size_t part = 1; part < 4; ++part)
+    {
+        control.replace(starts / 4 * part - 2, pattern.size(), pattern);
+    }
+    TestingString test = chunkyFrom(control);
+
+    EXPECT_EQ(control.find(pattern), test.parallel_find(pattern, 0, 4));
+    EXPECT_EQ(control.find(pattern, size / 2), 
+              test.parallel_find(pattern, size / 2, 4));
+    EXPECT_EQ(3u, test.parallel_count(pattern, 4));
+    EXPECT_EQ(size - 1, test.parallel_count("..", 4) + 3 * 7);
+    EXPECT_EQ(TestingString::npos, test.parallel_find("needles", 0, 4));
+}
+
+TEST(assign, parallel_build)
+{
+    string control;
+    for (size_t i = 0; i < 4 * TestingString::PARALLEL_GRAIN + 7; ++i)
+    {
+        control.push_back(randomChar());
+    }
+    TestingString test = chunkyFrom("old contents");
+    test.assign(control.data(), control.size(), 4);
+    checkWithControl(test, control, "built on four threads");
+    checkCompact(test, "built on four threads");
+
+    TestingString serial;
+    serial.assign(control.data(), control.size(), 1);
+    EXPECT_TRUE(serial == test);
+}
+
+TEST(assign, small_and_marked)
+{
+    TestingString test = chunkyFrom("a string with marks in it");
+    TestingString::Mark near(test, std::next(test.begin(), 2));
+    TestingString::Mark far(test, std::next(test.begin(), 20));
+
+    string control = "short one";
+    test.assign(control.data(), control.size());
+    checkWithControl(test, control, "assigning a short string");
+    EXPECT_EQ(2u, near.offset());
+    EXPECT_TRUE(far.position() == test.end());
+
+    test.assign("", 0);
+    checkWithControl(test, "", "assigning nothing");
+    EXPECT_EQ(0u, near.offset());
+}
+
+#if INSERT_ERASE
+TEST(concurrent, edits_match_control)
+{
+    ConcurrentChunkyString test;
+    string control;
+    EXPECT_THROW(test.insert(1, "x"), std::out_of_range);
+
+    // enough text to split into several segments
+    for (size_t i = 0; i < 5 * ConcurrentChunkyString::SEGMENT_SIZE; ++i)
+    {
+        char c = randomChar();
+        test.push_back(c);
+        control.push_back(c);
+    }
+    EXPECT_LT(1u, test.segments());
+
+    for (size_t i = 0; i < 200; ++i)
+    {
+        size_t offset = rand() % (control.size() + 1);
+        if (rand() % 2 == 0)
+        {
+            string text(rand() % 50, randomChar());
+            test.insert(offset, text);
+            control.insert(offset, text);
+        }
+        else
+        {
+            // long enough to run across segment boundaries now and then
+            size_t count = std::min<size_t>(rand() % 6000,
+                                            control.size() - offset);
+            test.erase(offset, count);
+            control.erase(offset, count);
+        }
+        ASSERT_EQ(control.size(), test.size());
+    }
+    EXPECT_EQ(control, test.str());
+
+    EXPECT_THROW(test.erase(control.size() - 1, 2), std::out_of_range);
+    EXPECT_EQ(control, test.str());
+    test.erase(0, control.size());
+    EXPECT_EQ("", test.str());
+    EXPECT_EQ(1u, test.segments());
+}
+
+TEST(concurrent, threads_edit_and_read)
+{
+    const size_t SEGMENT = ConcurrentChunkyString::SEGMENT_SIZE;
+    const size_t THREADS = 4;
+    const size_t EDITS = 500;
+
+    // one region per thread, each a string of its own letter
+    ConcurrentChunkyString test;
+    for (size_t t = 0; t < THREADS; ++t)
+    {
+        test += string(SEGMENT, char('a' + t));
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < THREADS; ++t)
+    {
+        threads.push_back(std::thread([&test, t, SEGMENT, EDITS] {
+            // every edit is undone right away, so this offset stays in
+            // the region
+            size_t offset = t * SEGMENT + SEGMENT / 2;
+            for (size_t i = 0; i < EDITS; ++i)
+            {
+                test.insert(offset, string(2, char('a' + t)));
+                test.erase(offset, 2);
+            }
+        }));
+    }
+
+    // readers only ever see whole edits, which keep the length even
+    bool evenLengths = true;
+    std::thread reader([&test, &evenLengths] {
+        for (size_t i = 0; i < 50; ++i)
+        {
+            evenLengths = evenLengths && test.str().size() % 2 == 0;
+            evenLengths = evenLengths && test.size() % 2 == 0;
+        }
+    });
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    reader.join();
+    EXPECT_TRUE(evenLengths);
+
+    string result = test.str();
+    EXPECT_EQ(THREADS * SEGMENT, result.size());
+    for (size_t t = 0; t < THREADS; ++t)
+    {
+        EXPECT_EQ(SEGMENT, size_t(std::count(result.begin(),
+                                                     result.end(),
+                                                     char('a' + t))));
+    }
+    EXPECT_TRUE(std::is_sorted(result.begin(), result.end()));
+}
+#endif
+
+TEST(concurrent, many_readers)
+{
+    const size_t SEGMENT = ConcurrentChunkyString::SEGMENT_SIZE;
+    const size_t READERS = 4;
+
+    ConcurrentChunkyString test;
+    string control;
+    for (size_t t = 0; t < 4; ++t)
+    {
+        control += string(SEGMENT, char('a' + t));
+    }
+    test += control;
+
+    // readers share each segment's lock, with one writer waiting between
+    // them; none may see anything but whole edits
+    std::atomic<size_t> wrong(0);
+    std::vector<std::thread> readers;
+    for (size_t r = 0; r < READERS; ++r)
+    {
+        readers.push_back(std::thread([&test, &control, &wrong] {
+            for (size_t i = 0; i < 50; ++i)
+            {
+                string text = test.str();
+                wrong += text != control && text.size() != control.size() + 2;
+                wrong += test.size() % 2 != 0;
+            }
+        }));
+    }
+    std::thread writer([&test, SEGMENT] {
+        for (size_t i = 0; i < 100; ++i)
+        {
+            test.insert(SEGMENT, "!!");
+            test.erase(SEGMENT, 2);
+        }
+    });
+    for (std::thread& reader : readers)
+    {
+        reader.join();
+    }
+    writer.join();
+
+    EXPECT_EQ(0u, wrong.load());
+    EXPECT_EQ(control, test.str());
+}
+
+TEST(append_only, matches_control)
+{
+    AppendOnlyChunkyString test;
+    string control;
+    EXPECT_EQ(0u, test.size());
+    EXPECT_TRUE(test.begin() == test.end());
+
+    for (size_t i = 0; i < 3 * AppendOnlyChunkyString::BLOCK_SIZE; ++i)
+    {
+        char c = randomChar();
+        test.push_back(c);
+        control.push_back(c);
+        if (i % 1000 == 0)
+        {
+            string text(rand() % 100, randomChar());
+            test += text;
+            control += text;
+        }
+    }
+
+    // longer than a block, so it gets one of its own
+    string big(2 * AppendOnlyChunkyString::BLOCK_SIZE + 5, 'z');
+    test += big;
+    control += big;
+    test += "";
+    test += "tail";
+    control += "tail";
+
+    EXPECT_EQ(control.size(), test.size());
+    EXPECT_EQ(control, test.str());
+    EXPECT_TRUE(std::equal(control.begin(), control.end(), test.begin()));
+    EXPECT_EQ(control.size(), size_t(std::distance(test.begin(),
+                                                   test.end())));
+}
+
+TEST(append_only, threads_append_whole_records)
+{
+    const size_t THREADS = 4;
+    const size_t RECORDS = 3000;
+    const size_t RECORD_SIZE = 8;
+
+    // records look like "b000042\n": thread letter, then sequence number
+    AppendOnlyChunkyString test;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < THREADS; ++t)
+    {
+        threads.push_back(std::thread([&test, t, RECORDS] {
+            char record[9];
+            for (size_t i = 0; i < RECORDS; ++i)
+            {
+                snprintf(record, sizeof(record), "%c%06zu\n", char('a' + t),
+                         i);
+                test.append(record, 8);
+            }
+        }));
+    }
+
+    // readers see whole records, each thread's in order
+    auto wellFormed = [THREADS, RECORD_SIZE](const string& text) {
+        if (text.size() % RECORD_SIZE != 0)
+        {
+            return false;
+        }
+        std::vector<size_t> next(THREADS, 0);
+        for (size_t at = 0; at < text.size(); at += RECORD_SIZE)
+        {
+            size_t t = text[at] - 'a';
+            if (t >= THREADS || text[at + RECORD_SIZE - 1] != '\n'
+                || std::stoul(text.substr(at + 1, 6)) != next[t]++)
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+    bool readsWellFormed = true;
+    std::thread reader([&test, &readsWellFormed, &wellFormed] {
+        for (size_t i = 0; i < 20; ++i)
+        {
+            readsWellFormed = readsWellFormed && wellFormed(test.str());
+        }
+    });
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+    reader.join();
+    EXPECT_TRUE(readsWellFormed);
+
+    string result = test.str();
+    EXPECT_EQ(THREADS * RECORDS * RECORD_SIZE, result.size());
+    EXPECT_TRUE(wellFormed(result));
+}
+
+TEST(append_only, stress_keeps_records_whole_and_in_order)
+{
+    const size_t THREADS = 8;
+    const size_t RECORDS = 4000;
+
+    // records look like "c004217 17 qqqqqqqqqqqqqqqqq\n": thread letter,
+    // sequence number, then a payload whose length and letter depend on
+    // both, so torn or misplaced records show up
+    auto payload = [](size_t t, size_t i) {
+        return string((t * 7 + i * 13) % 90, char('a' + (t + i) % 26));
+    };
+    auto record = [&payload](size_t t, size_t i) {
+        string text = payload(t, i);
+        char header[16];
+        snprintf(header, sizeof(header), "%c%06zu %02zu ", char('A' + t), i,
+                 text.size());
+        return header + text + "\n";
+    };
+
+    // whole records only, each thread's numbered without gaps
+    auto check = [THREADS, &payload](const string& text,
+                                     std::vector<size_t>& next) {
+        next.assign(THREADS, 0);
+        size_t at = 0;
+        while (at < text.size())
+        {
+            if (text.size() - at < 12 || text[at + 7] != ' ')
+            {
+                return false;
+            }
+            size_t t = text[at] - 'A';
+            if (t >= THREADS
+                || std::stoul(text.substr(at + 1, 6)) != next[t])
+            {
+                return false;
+            }
+            size_t length = std::stoul(text.substr(at + 8, 2));
+            string expected = payload(t, next[t]++);
+            if (length != expected.size()
+                || text.size() - at < 12 + length
+                || text.compare(at + 11, length, expected) != 0
+                || text[at + 11 + length] != '\n')
+            {
+                return false;
+            }
+            at += 12 + length;
+        }
+        return true;
+    };
+
+    AppendOnlyChunkyString test;
+    std::atomic<bool> done{false};
+    std::atomic<bool> readsWellFormed{true};
+    std::vector<std::thread> readers;
+    for (size_t r = 0; r < 2; ++r)
+    {
+        readers.push_back(std::thread([&] {
+            std::vector<size_t> next;
+            size_t seen = 0;
+            while (!done.load())
+            {
+                string text = test.str();
+                if (text.size() < seen || !check(text, next))
+                {
+                    readsWellFormed = false;
+                }
+                seen = text.size();
+            }
+        }));
+    }
+
+    std::vector<std::thread> writers;
+    for (size_t t = 0; t < THREADS; ++t)
+    {
+        writers.push_back(std::thread([&test, &record, t, RECORDS] {
+            for (size_t i = 0; i < RECORDS; ++i)
+            {
+                test += record(t, i);
+            }
+        }));
+    }
+    for (std::thread& writer : writers)
+    {
+        writer.join();
+    }
+    done = true;
+    for (std::thread& reader : readers)
+    {
+        reader.join();
+    }
+    EXPECT_TRUE(readsWellFormed);
+
+    // once the writers are done, everything is published
+    size_t total = 0;
+    for (size_t t = 0; t < THREADS; ++t)
+    {
+        for (size_t i = 0; i < RECORDS; ++i)
+        {
+            total += record(t, i).size();
+        }
+    }
+    string result = test.str();
+    EXPECT_EQ(total, test.size());
+    EXPECT_EQ(total, result.size());
+    std::vector<size_t> next;
+    EXPECT_TRUE(check(result, next));
+    EXPECT_EQ(std::vector<size_t>(THREADS, RECORDS), next);
+}
+
+TEST(for_each, chunks_cover_string)
+{
+    string control(7 * CHUNKSIZE + 3, 'x');
+    for (size_t i = 0; i < control.size(); ++i)
+    {
+        control[i] = 'a' + i % 26;
+    }
+    const TestingString test = chunkyFrom(control);
+
+    string seen;
+    size_t calls = 0;
+    test.for_each_chunk([&](const char* chars, size_t length) {
+        seen.append(chars, length);
+        ++calls;
+    });
+    EXPECT_EQ(control, seen);
+    EXPECT_EQ(8u, calls);
+}
+
+TEST(for_each, char_counting)
+{
+    const TestingString test = chunkyFrom(UTF8_SAMPLE);
+
+    struct CountLeads {
+        size_t leads_;
+        void operator()(char c)
+        {
+            leads_ += (static_cast<unsigned char>(c) & 0xC0) != 0x80;
+        }
+    };
+    CountLeads counter = test.for_each_char(CountLeads{0});
+    EXPECT_EQ(test.codepoints(), counter.leads_);
+}
+
+TEST(for_each, char_writes_invalidate_caches)
+{
+    string control = "chunky strings are chunky";
+    TestingString test = chunkyFrom(control);
+    size_t oldHash = test.hash();
+    test.codepoints();
+
+    test.for_each_char([](char& c) {
+        if (c >= 'a' && c <= 'z')
+        {
+            c = c - 'a' + 'A';
+        }
+    });
+
+    string upper = "CHUNKY STRINGS ARE CHUNKY";
+    checkWithControl(test, upper, "upper-casing with for_each_char");
+    EXPECT_NE(oldHash, test.hash());
+    EXPECT_EQ(chunkyFrom(upper).hash(), test.hash());
+
+    // writing continuation bytes changes the code-point count
+    test.for_each_chunk([](char* chars, size_t length) {
+        for (size_t i = 0; i < length; ++i)
+        {
+            chars[i] = '\x80';
+        }
+    });
+    EXPECT_EQ(0u, test.codepoints());
+}
+
+TEST(transform, toupper)
+{
+    string control = "Chunky strings, 12 chars at a time";
+    TestingString test = chunkyFrom(control);
+    TestingString::const_iterator before = test.begin();
+
+    test.transform_inplace([](char c) {
+        return static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+    });
+    std::transform(control.begin(), control.end(), control.begin(),
+                   [](char c) { 
+                       return std::toupper(static_cast<unsigned char>(c));
+                   });
+
+    checkWithControl(test, control, "transform_inplace toupper");
+    EXPECT_TRUE(before == test.begin());
+    EXPECT_EQ(chunkyFrom(control).hash(), test.hash());
+}
+
+TEST(transform, translate_table)
+{
+    char rot13[256];
+    for (size_t c = 0; c < 256; ++c)
+    {
+        rot13[c] = static_cast<char>(c);
+    }
+    for (char c = 'a'; c <= 'z'; ++c)
+    {
+        rot13[size_t(c)] = 'a' + (c - 'a' + 13) % 26;
+    }
+
+    TestingString test = chunkyFrom("hello, chunky world");
+    test.translate(rot13);
+    checkWithControl(test, "uryyb, puhaxl jbeyq", "translating rot13");
+    test.translate(rot13);
+    checkWithControl(test, "hello, chunky world", "translating back");
+}
+
+TEST(transform, translate_like_tr)
+{
+    TestingString test = chunkyFrom(UTF8_SAMPLE);
+    size_t codepoints = test.codepoints();
+
+    // every byte with the high bit set becomes '?'
+    string from;
+    for (int c = 0x80; c < 0x100; ++c)
+    {
+        from.push_back(static_cast<char>(c));
+    }
+    test.translate(from, "?");
+
+    EXPECT_EQ(test.size(), test.codepoints());
+    EXPECT_LT(codepoints, test.codepoints());
+
+    TestingString abc = chunkyFrom("aabbccdd");
+    abc.translate("abc", "xy");
+    checkWithControl(abc, "xxyyyydd", "translating abc to xy");
+
+    // nothing to translate to is an error, and changes nothing
+    EXPECT_THROW(abc.translate("xy", ""), std::invalid_argument);
+    abc.translate("", "z");
+    checkWithControl(abc, "xxyyyydd", "translating with empty sets");
+}
+
+#if INSERT_ERASE
+TEST(instrumentation, counts_operations)
+{
+    TestingString test;
+    TestingString::reset_op_counters();
+
+    for (size_t i = 0; i < 10 * CHUNKSIZE; ++i)
+    {
+        test.push_back('a');
+    }
+    for (size_t i = 0; i < CHUNKSIZE; ++i)
+    {
+        test.insert(test.begin(), 'b');
+    }
+    for (size_t i = 0; i < CHUNKSIZE; ++i)
+    {
+        test.erase(test.begin());
+    }
+
+    const TestingString::OpCounters& counters = 
+        TestingString::op_counters();
+    if (!TestingString::instrumented())
+    {
+        // nothing is recorded
+        EXPECT_EQ(0u, counters.counts_[TestingString::PUSH_BACK]);
+        return;
+    }
+
+    EXPECT_EQ(10 * CHUNKSIZE, counters.counts_[TestingString::PUSH_BACK]);
+    EXPECT_EQ(CHUNKSIZE, counters.counts_[TestingString::INSERT]);
+    EXPECT_EQ(CHUNKSIZE, counters.counts_[TestingString::ERASE]);
+    EXPECT_LT(0u, counters.counts_[TestingString::SPLIT]);
+    EXPECT_LT(0u, counters.counts_[TestingString::ALLOCATION]);
+
+    // every timed event lands in exactly one bucket
+    for (size_t e = 0; e <= TestingString::REFLOW; ++e)
+    {
+        size_t timed = 0;
+        for (size_t b = 0; b < TestingString::LATENCY_BUCKETS; ++b)
+        {
+            timed += counters.latencies_[e][b];
+        }
+        EXPECT_EQ(counters.counts_[e], timed);
+    }
+}
+#endif
+
+TEST(instrumentation, dump)
+{
+    TestingString::reset_op_counters();
+    TestingString test = chunkyFrom("abc");
+
+    std::ostringstream text;
+    TestingString::dump_op_counters(text);
+    EXPECT_NE(string::npos, text.str().find("push_back: "));
+
+    std::ostringstream json;
+    TestingString::dump_op_counters(json, true);
+    EXPECT_EQ('{', json.str().front());
+    EXPECT_NE(string::npos, json.str().find("\"merge\": {\"count\": 0}"));
+}
+
 #if INSERT_ERASE
 TEST(utilization, only_insert)
 {
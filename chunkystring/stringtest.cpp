@@ -21,7 +21,7 @@
 #define LOAD_GENERIC_STRING 0       // 0 = Normal, 1 = Load Code Dynamically
 #endif
 
-#define INSERT_ERASE 0 // 0 = Do not test. 1 = Do test.
+#define INSERT_ERASE 1 // 0 = Do not test. 1 = Do test.
 
 
 #if LOAD_GENERIC_STRING
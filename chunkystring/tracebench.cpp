@@ -0,0 +1,552 @@
+/**
+ * \file tracebench.cpp
+ *
+ * \authors Ricky Pan, Iris Liu
+ *
+ * \brief Replays recorded editor traces against ChunkyString.
+ *
+ * \details A trace is a text file with one operation per line:
+ *
+ *              seek POS        move the cursor to offset POS
+ *              insert TEXT     insert TEXT at the cursor, leaving the
+ *                              cursor after it
+ *              erase N         erase N characters after the cursor
+ *              append TEXT     add TEXT to the end of the string
+ *
+ *          TEXT runs to the end of the line and may use the escapes
+ *          `\n`, `\t` and `\\`. Blank lines and lines starting with `#`
+ *          are ignored.
+ *
+ *          Each trace is replayed once untimed per operation to measure
+ *          throughput, and once with every operation timed to measure
+ *          latency, against both ChunkyString and std::string; the final
+ *          contents of the two must agree.
+ *
+ *          Usage:
+ *
+ *              ./tracebench TRACE...
+ *              ./tracebench --generate=typing|refactor|log
+ *                           [--ops=N] [--seed=N] > TRACE
+ *
+ *          The traces in traces/ were made with --generate.
+ */
+
+#include "chunkystring.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using std::size_t;
+
+namespace {
+
+/// One line of a trace
+struct Op {
+    enum Kind { SEEK, INSERT, ERASE, APPEND };
+
+    Kind kind_;
+    size_t count_;          // position for SEEK, length for ERASE
+    std::string text_;      // for INSERT and APPEND
+};
+
+/// Undo the escapes allowed in TEXT
+std::string unescape(const std::string& text, size_t line)
+{
+    std::string result;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        if (text[i] != '\\')
+        {
+            result.push_back(text[i]);
+            continue;
+        }
+        if (++i == text.size())
+        {
+            throw std::runtime_error("line " + std::to_string(line)
+                                     + ": trailing backslash");
+        }
+        switch (text[i])
+        {
+        case 'n':
+            result.push_back('\n');
+            break;
+        case 't':
+            result.push_back('\t');
+            break;
+        case '\\':
+            result.push_back('\\');
+            break;
+        default:
+            throw std::runtime_error("line " + std::to_string(line)
+                                     + ": unknown escape");
+        }
+    }
+    return result;
+}
+
+/// Escape text so that it fits on one trace line
+std::string escape(const std::string& text)
+{
+    std::string result;
+    for (char c : text)
+    {
+        if (c == '\n')
+        {
+            result += "\\n";
+        }
+        else if (c == '\t')
+        {
+            result += "\\t";
+        }
+        else if (c == '\\')
+        {
+            result += "\\\\";
+        }
+        else
+        {
+            result.push_back(c);
+        }
+    }
+    return result;
+}
+
+/// Read a whole trace
+std::vector<Op> readTrace(std::istream& in)
+{
+    std::vector<Op> ops;
+    std::string line;
+    for (size_t number = 1; std::getline(in, line); ++number)
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        size_t space = line.find(' ');
+        std::string word = line.substr(0, space);
+        std::string rest = space == std::string::npos ? ""
+                                                      : line.substr(space + 1);
+        Op op;
+        if (word == "seek" || word == "erase")
+        {
+            char* end;
+            op.kind_ = word == "seek" ? Op::SEEK : Op::ERASE;
+            op.count_ = std::strtoull(rest.c_str(), &end, 10);
+            if (rest.empty() || *end != '\0')
+            {
+                throw std::runtime_error("line " + std::to_string(number)
+                                         + ": expected a number");
+            }
+        }
+        else if (word == "insert" || word == "append")
+        {
+            op.kind_ = word == "insert" ? Op::INSERT : Op::APPEND;
+            op.count_ = 0;
+            op.text_ = unescape(rest, number);
+        }
+        else
+        {
+            throw std::runtime_error("line " + std::to_string(number)
+                                     + ": unknown operation '" + word + "'");
+        }
+        ops.push_back(op);
+    }
+    return ops;
+}
+
+/// Make the cursor valid again after appending to s
+void afterAppend(std::string& s, std::string::iterator& cursor,
+                 size_t position, size_t)
+{
+    // any growth may have reallocated
+    cursor = s.begin() + position;
+}
+
+void afterAppend(ChunkyString& s, ChunkyString::iterator& cursor,
+                 size_t position, size_t oldSize)
+{
+    // push_back leaves iterators to characters alone; only end() moved
+    if (position == oldSize)
+    {
+        cursor = s.end();
+        std::advance(cursor, -static_cast<long>(s.size() - oldSize));
+    }
+}
+
+/**
+ * \class Replay
+ * \brief Applies trace operations to a string through one cursor,
+ *        the way an editor would.
+ */
+template <typename S>
+class Replay {
+public:
+    Replay()
+        : cursor_{text_.begin()}, position_{0}
+    {
+        // Nothing to do here!
+    }
+
+    void apply(const Op& op)
+    {
+        switch (op.kind_)
+        {
+        case Op::SEEK:
+            seek(op.count_);
+            break;
+        case Op::INSERT:
+            for (char c : op.text_)
+            {
+                cursor_ = text_.insert(cursor_, c);
+                ++cursor_;
+            }
+            position_ += op.text_.size();
+            break;
+        case Op::ERASE:
+            if (op.count_ > text_.size() - position_)
+            {
+                throw std::out_of_range("erase past the end");
+            }
+            for (size_t i = 0; i < op.count_; ++i)
+            {
+                cursor_ = text_.erase(cursor_);
+            }
+            break;
+        case Op::APPEND:
+        {
+            size_t oldSize = text_.size();
+            for (char c : op.text_)
+            {
+                text_.push_back(c);
+            }
+            afterAppend(text_, cursor_, position_, oldSize);
+            break;
+        }
+        }
+    }
+
+    const S& text() const
+    {
+        return text_;
+    }
+
+private:
+    /// Walk to target from the cursor or whichever end is closer
+    void seek(size_t target)
+    {
+        if (target > text_.size())
+        {
+            throw std::out_of_range("seek past the end");
+        }
+
+        long delta = static_cast<long>(target) - static_cast<long>(position_);
+        if (static_cast<long>(target) < std::labs(delta))
+        {
+            cursor_ = text_.begin();
+            delta = target;
+        }
+        if (static_cast<long>(text_.size() - target) < std::labs(delta))
+        {
+            cursor_ = text_.end();
+            delta = static_cast<long>(target)
+                    - static_cast<long>(text_.size());
+        }
+        std::advance(cursor_, delta);
+        position_ = target;
+    }
+
+    S text_;
+    typename S::iterator cursor_;
+    size_t position_;
+};
+
+/// What replaying one trace against one string type measured
+struct Result {
+    double opsPerSecond_;
+    std::vector<double> latencies_;     // ns per op, sorted
+};
+
+template <typename S>
+Result replay(const std::vector<Op>& ops, S& text)
+{
+    using clock = std::chrono::steady_clock;
+    Result result;
+
+    {
+        Replay<S> untimed;
+        clock::time_point start = clock::now();
+        for (const Op& op : ops)
+        {
+            untimed.apply(op);
+        }
+        double seconds =
+            std::chrono::duration<double>(clock::now() - start).count();
+        result.opsPerSecond_ = ops.size() / seconds;
+    }
+
+    Replay<S> timed;
+    result.latencies_.reserve(ops.size());
+    for (const Op& op : ops)
+    {
+        clock::time_point start = clock::now();
+        timed.apply(op);
+        result.latencies_.push_back(
+            std::chrono::duration<double, std::nano>(clock::now() - start)
+                .count());
+    }
+    std::sort(result.latencies_.begin(), result.latencies_.end());
+    text = timed.text();
+    return result;
+}
+
+/// The latency that fraction of operations finished within
+double percentile(const std::vector<double>& sorted, double fraction)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+void printRow(const std::string& name, const Result& result)
+{
+    std::cout << "  " << std::left << std::setw(14) << name << std::right
+              << std::fixed << std::setprecision(0)
+              << std::setw(12) << result.opsPerSecond_
+              << std::setw(10) << percentile(result.latencies_, 0.5)
+              << std::setw(10) << percentile(result.latencies_, 0.9)
+              << std::setw(10) << percentile(result.latencies_, 0.99)
+              << std::setw(10) << percentile(result.latencies_, 0.999)
+              << std::setw(10) << percentile(result.latencies_, 1.0);
+}
+
+/// Replay one trace file and print what it measured; false on failure
+bool run(const char* path)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        std::cerr << path << ": cannot open" << std::endl;
+        return false;
+    }
+
+    try
+    {
+        std::vector<Op> ops = readTrace(in);
+        ChunkyString chunky;
+        std::string control;
+        Result chunkyResult = replay(ops, chunky);
+        Result controlResult = replay(ops, control);
+
+        if (chunky.size() != control.size()
+            || !std::equal(control.begin(), control.end(), chunky.begin()))
+        {
+            std::cerr << path << ": ChunkyString and std::string disagree"
+                      << std::endl;
+            return false;
+        }
+
+        std::cout << path << ": " << ops.size() << " ops, final size "
+                  << chunky.size() << std::endl
+                  << "  " << std::left << std::setw(14) << "" << std::right
+                  << std::setw(12) << "ops/s" << std::setw(10) << "p50 ns"
+                  << std::setw(10) << "p90 ns" << std::setw(10) << "p99 ns"
+                  << std::setw(10) << "p99.9 ns" << std::setw(10) << "max ns"
+                  << std::setw(13) << "utilization" << std::endl;
+        printRow("ChunkyString", chunkyResult);
+        std::cout << std::setw(13) << std::setprecision(3)
+                  << chunky.utilization() << std::endl;
+        printRow("std::string", controlResult);
+        std::cout << std::endl;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << path << ": " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * \brief Write a synthetic trace to out
+ *
+ * \details All kinds start from a document of a few thousand characters.
+ *          "typing" edits in bursts near a cursor that drifts slowly,
+ *          with backspacing; "refactor" jumps around, replacing larger
+ *          spans; "log" mostly appends, with small edits near the end.
+ */
+void generate(const std::string& kind, size_t count, unsigned seed,
+              std::ostream& out)
+{
+    static const char* const WORDS[] = {
+        "the ", "chunk ", "string ", "insert ", "erase ", "cursor ",
+        "buffer ", "and ", "of ", "to ", "edit ", "line ", "text ",
+        "{ ", "} ", "int ", "return ", "if ", "for ", "while "
+    };
+    const size_t wordCount = sizeof(WORDS) / sizeof(WORDS[0]);
+
+    std::mt19937 rng(seed);
+    auto random = [&rng](size_t lo, size_t hi) {
+        return std::uniform_int_distribution<size_t>(lo, hi)(rng);
+    };
+    auto words = [&](size_t n) {
+        std::string text;
+        for (size_t i = 0; i < n; ++i)
+        {
+            text += WORDS[random(0, wordCount - 1)];
+            if (random(0, 7) == 0)
+            {
+                text += "\n";
+            }
+        }
+        return text;
+    };
+
+    out << "# " << kind << " trace: " << count << " ops, seed " << seed
+        << std::endl;
+
+    // keep a model of the size so that every operation is valid
+    size_t size = 0;
+    size_t cursor = 0;
+    for (size_t i = 0; i < 40; ++i)
+    {
+        std::string text = words(20);
+        out << "append " << escape(text) << std::endl;
+        size += text.size();
+    }
+
+    for (size_t op = 40; op < count; ++op)
+    {
+        size_t roll = random(0, 99);
+        if (kind == "log" && roll < 85)
+        {
+            std::string text = words(random(4, 12)) + "\n";
+            out << "append " << escape(text) << std::endl;
+            size += text.size();
+        }
+        else if (kind == "log")
+        {
+            cursor = size - std::min(size, random(0, 200));
+            out << "seek " << cursor << std::endl;
+            std::string text = words(1);
+            out << "insert " << escape(text) << std::endl;
+            size += text.size();
+            cursor += text.size();
+            ++op;
+        }
+        else if (roll < 15)
+        {
+            // move: a short hop while typing, anywhere while refactoring
+            if (kind == "typing")
+            {
+                size_t hop = random(0, 80);
+                cursor = random(0, 1) ? std::min(size, cursor + hop)
+                                      : cursor - std::min(cursor, hop);
+            }
+            else
+            {
+                cursor = random(0, size);
+            }
+            out << "seek " << cursor << std::endl;
+        }
+        else if (roll < 30 && cursor > 0)
+        {
+            // backspace or delete a span
+            size_t span = kind == "typing" ? random(1, 3) : random(5, 60);
+            span = std::min(span, cursor);
+            cursor -= span;
+            out << "seek " << cursor << std::endl
+                << "erase " << span << std::endl;
+            size -= span;
+            ++op;
+        }
+        else
+        {
+            std::string text =
+                kind == "typing" ? words(1) : words(random(1, 10));
+            out << "insert " << escape(text) << std::endl;
+            size += text.size();
+            cursor += text.size();
+        }
+    }
+}
+
+/// Value of a --name=value option, or nullptr if arg isn't that option
+const char* option(const char* arg, const char* name)
+{
+    size_t length = std::strlen(name);
+    if (std::strncmp(arg, name, length) == 0 && arg[length] == '=')
+    {
+        return arg + length + 1;
+    }
+    return nullptr;
+}
+
+} // end of anonymous namespace
+
+int main(int argc, char** argv)
+{
+    std::string kind;
+    size_t count = 10000;
+    unsigned seed = 1;
+    std::vector<const char*> traces;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (const char* value = option(argv[i], "--generate"))
+        {
+            kind = value;
+        }
+        else if (const char* value = option(argv[i], "--ops"))
+        {
+            count = std::strtoull(value, nullptr, 10);
+        }
+        else if (const char* value = option(argv[i], "--seed"))
+        {
+            seed = std::strtoul(value, nullptr, 10);
+        }
+        else if (argv[i][0] != '-')
+        {
+            traces.push_back(argv[i]);
+        }
+        else
+        {
+            traces.clear();
+            break;
+        }
+    }
+
+    if (kind == "typing" || kind == "refactor" || kind == "log")
+    {
+        generate(kind, count, seed, std::cout);
+        return 0;
+    }
+    if (!kind.empty() || traces.empty())
+    {
+        std::cerr << "usage: " << argv[0] << " TRACE..." << std::endl
+                  << "       " << argv[0]
+                  << " --generate=typing|refactor|log [--ops=N] [--seed=N]"
+                  << std::endl;
+        return 1;
+    }
+
+    bool ok = true;
+    for (const char* path : traces)
+    {
+        ok = run(path) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,72 @@
+/*********************************************************************
+ * ChunkyString internal iteration.
+ *********************************************************************
+ *
+ * Implementation for the for_each_chunk, for_each_char and
+ * transform_inplace member templates
+ *
+ */
+
+template <typename F>
+F ChunkyString::for_each_chunk(F f) const
+{
+    for (const Chunk& chunk : chunks_)
+    {
+        f(static_cast<const char*>(chunk.chars_), chunk.length_);
+    }
+    return f;
+}
+
+template <typename F>
+F ChunkyString::for_each_chunk(F f)
+{
+    // f may rewrite any character
+    changed();
+    for (Chunk& chunk : chunks_)
+    {
+        f(static_cast<char*>(chunk.chars_), chunk.length_);
+        recount(chunk);
+    }
+    return f;
+}
+
+template <typename F>
+F ChunkyString::for_each_char(F f) const
+{
+    for (const Chunk& chunk : chunks_)
+    {
+        const char* chars = chunk.chars_;
+        for (size_t i = 0, n = chunk.length_; i < n; ++i)
+        {
+            f(chars[i]);
+        }
+    }
+    return f;
+}
+
+template <typename F>
+F ChunkyString::for_each_char(F f)
+{
+    changed();
+    for (Chunk& chunk : chunks_)
+    {
+        char* chars = chunk.chars_;
+        for (size_t i = 0, n = chunk.length_; i < n; ++i)
+        {
+            f(chars[i]);
+        }
+        recount(chunk);
+    }
+    return f;
+}
+
+template <typename F>
+void ChunkyString::transform_inplace(F f)
+{
+    for_each_chunk([&f](char* chars, size_t length) {
+        for (size_t i = 0; i < length; ++i)
+        {
+            chars[i] = f(chars[i]);
+        }
+    });
+}